@@ -1,7 +1,9 @@
+#include <algorithm>
+#include <bitset>
 #include <sstream>
 #include <string>
-#include <unordered_map>
-#include <unordered_set>
+#include <vector>
+#include "weston-extra-dip-trace.h"
 
 extern "C" {
 #include <compositor.h>
@@ -11,106 +13,331 @@ extern "C" {
 #include "weston-extra-dip-capabilities-api.h"
 #include "wldip-capabilities-server-protocol.h"
 
-static std::string join_caps(std::unordered_set<std::string> &caps) {
-	std::stringstream ss;
-	for (const auto &cap : caps) {
-		ss << cap << ", ";
-	}
-	return ss.str();
-}
+using cap_bits = std::bitset<WESTON_EXTRA_DIP_CAPABILITIES_MAX>;
 
 struct extra_dip_capabilities {
 	bool first_client_arrived = false;
 	struct weston_compositor *compositor = nullptr;
-	std::unordered_set<std::string> known_caps;
-	std::unordered_map<struct wl_client *, std::unordered_set<std::string>> caps;
+	// indexed by capability id
+	std::vector<std::string> known_caps;
+	struct wl_list capability_sets {};
 	struct wl_listener vip_destroy_listener {};
 };
 
 struct extra_dip_capabilities global_capabilities;
 
+static extra_dip_trace_ring trace("capabilities");
+
+// Grants live with the client, they're found through its destroy listener
+struct client_caps {
+	struct wl_client *client;
+	struct wl_listener destroy_listener {};
+	cap_bits caps;
+	// in the pooled list of the capability_set this connection was spawned for
+	struct wl_list pool_link {};
+};
+
+static void client_is_down(struct wl_listener *listener, void *data);
+
+static struct client_caps *client_caps_get(struct wl_client *client) {
+	auto *listener = wl_client_get_destroy_listener(client, client_is_down);
+	if (listener == nullptr) {
+		return nullptr;
+	}
+	return wl_container_of(listener, static_cast<struct client_caps *>(nullptr), destroy_listener);
+}
+
+static struct client_caps *client_caps_ensure(struct wl_client *client) {
+	auto *cc = client_caps_get(client);
+	if (cc == nullptr) {
+		cc = new client_caps;
+		cc->client = client;
+		wl_list_init(&cc->pool_link);
+		cc->destroy_listener.notify = client_is_down;
+		wl_client_add_destroy_listener(client, &cc->destroy_listener);
+	}
+	return cc;
+}
+
+static void client_is_down(struct wl_listener *listener, void *data) {
+	auto *cc =
+	    wl_container_of(listener, static_cast<struct client_caps *>(nullptr), destroy_listener);
+	EXTRA_DIP_TRACE(trace, EXTRA_DIP_TRACE_INFO, "cleanup client", reinterpret_cast<intptr_t>(data));
+	wl_list_remove(&listener->link);
+	wl_list_remove(&cc->pool_link);
+	delete cc;
+}
+
+static int32_t find_cap(const char *capability) {
+	const auto &known = global_capabilities.known_caps;
+	for (size_t i = 0; i < known.size(); i++) {
+		if (known[i] == capability) {
+			return static_cast<int32_t>(i);
+		}
+	}
+	return -1;
+}
+
+static std::string join_caps(const cap_bits &caps) {
+	std::stringstream ss;
+	const auto &known = global_capabilities.known_caps;
+	for (size_t i = 0; i < known.size(); i++) {
+		if (caps.test(i)) {
+			ss << known[i] << ", ";
+		}
+	}
+	return ss.str();
+}
+
 static struct extra_dip_capabilities *api_get(struct weston_compositor *compositor) {
 	return &global_capabilities;
 }
 
+static int32_t api2_create(struct extra_dip_capabilities *ctx, const char *capability) {
+	int32_t id = find_cap(capability);
+	if (id >= 0) {
+		return id;
+	}
+	if (ctx->known_caps.size() >= WESTON_EXTRA_DIP_CAPABILITIES_MAX) {
+		weston_log("capabilities: can't create capability '%s', too many capabilities\n", capability);
+		return -1;
+	}
+	// traces refer to capabilities by id (and to grants by bitset)
+	weston_log("capabilities: creating capability '%s' with id %zu\n", capability,
+	           ctx->known_caps.size());
+	ctx->known_caps.emplace_back(capability);
+	return static_cast<int32_t>(ctx->known_caps.size() - 1);
+}
+
+// Called for every bind and request that needs a capability, so it must stay cheap
+static bool api2_check(struct extra_dip_capabilities *ctx, struct wl_client *client,
+                       int32_t capability) {
+	if (capability < 0 || capability >= WESTON_EXTRA_DIP_CAPABILITIES_MAX) {
+		return false;
+	}
+	auto *cc = client_caps_get(client);
+	return cc != nullptr && cc->caps.test(capability);
+}
+
+static void api2_grant(struct extra_dip_capabilities *ctx, struct wl_client *client,
+                       int32_t capability) {
+	if (capability < 0 || static_cast<size_t>(capability) >= ctx->known_caps.size()) {
+		weston_log("capabilities: wanted to grant capability %d to client %p, but it wasn't created\n",
+		           capability, client);
+		return;
+	}
+	auto *cc = client_caps_ensure(client);
+	cc->caps.set(capability);
+	EXTRA_DIP_TRACE(trace, EXTRA_DIP_TRACE_INFO, "grant", reinterpret_cast<intptr_t>(client),
+	                capability, static_cast<int64_t>(cc->caps.to_ullong()));
+}
+
+static void cs_revoke(struct wl_client *client, int32_t capability);
+
+static void api2_revoke(struct extra_dip_capabilities *ctx, struct wl_client *client,
+                        int32_t capability) {
+	if (capability < 0 || static_cast<size_t>(capability) >= ctx->known_caps.size()) {
+		return;
+	}
+	auto *cc = client_caps_get(client);
+	if (cc != nullptr) {
+		cc->caps.reset(capability);
+		EXTRA_DIP_TRACE(trace, EXTRA_DIP_TRACE_INFO, "revoke", reinterpret_cast<intptr_t>(client),
+		                capability, static_cast<int64_t>(cc->caps.to_ullong()));
+	}
+	cs_revoke(client, capability);
+}
+
+static const struct weston_extra_dip_capabilities_api_v2 api_v2 = {api_get, api2_create, api2_check,
+                                                                   api2_grant, api2_revoke};
+
+// The v1 API looks the capability up by name and goes through v2
+
 static void api_create(struct extra_dip_capabilities *ctx, const char *capability) {
-	weston_log("capabilities: creating capability '%s'\n", capability);
-	ctx->known_caps.insert(std::string(capability));
+	api2_create(ctx, capability);
 }
 
 static bool api_check(struct extra_dip_capabilities *ctx, struct wl_client *client,
                       const char *capability) {
-	if (ctx->known_caps.count(std::string(capability)) == 0) {
+	int32_t id = find_cap(capability);
+	if (id < 0) {
 		weston_log(
 		    "capabilities: wanted to check capability '%s' on client %p, but it wasn't created\n",
 		    capability, client);
 		return false;
 	}
-	bool result = ctx->caps[client].count(std::string(capability)) > 0;
-	weston_log("capabilities: checking capability '%s' on client %p: %d\n", capability, client,
-	           static_cast<int>(result));
-	weston_log("capabilities: client %p capabilities: '%s'\n", client,
-	           join_caps(ctx->caps[client]).c_str());
-	return result;
+	return api2_check(ctx, client, id);
 }
 
 static void api_grant(struct extra_dip_capabilities *ctx, struct wl_client *client,
                       const char *capability) {
-	if (ctx->known_caps.count(std::string(capability)) == 0) {
+	int32_t id = find_cap(capability);
+	if (id < 0) {
 		weston_log(
 		    "capabilities: wanted to grant capability '%s' to client %p, but it wasn't created\n",
 		    capability, client);
 		return;
 	}
-	weston_log("capabilities: granting capability '%s' to client %p\n", capability, client);
-	ctx->caps[client].insert(std::string(capability));
-	weston_log("capabilities: client %p capabilities: '%s'\n", client,
-	           join_caps(ctx->caps[client]).c_str());
+	api2_grant(ctx, client, id);
 }
 
 static void api_revoke(struct extra_dip_capabilities *ctx, struct wl_client *client,
                        const char *capability) {
-	weston_log("capabilities: revoking capability '%s' from client %p\n", capability, client);
-	ctx->caps[client].erase(std::string(capability));
+	int32_t id = find_cap(capability);
+	if (id >= 0) {
+		api2_revoke(ctx, client, id);
+	}
 }
 
 static const struct weston_extra_dip_capabilities_api api = {api_get, api_create, api_check,
                                                              api_grant, api_revoke};
 
+const uint32_t cs_pool_max = 16;
+const size_t cs_pools_max = 8;
+
+struct cs_pool {
+	std::string name;
+	uint32_t size;
+	// connections sent to the client and not reported as taken yet
+	uint32_t ready;
+};
+
 struct capability_set {
-	std::unordered_set<std::string> caps;
+	cap_bits caps;
+	struct wl_resource *resource = nullptr;
+	std::vector<cs_pool> pools;
+	// connections spawned for the pools that are still alive, taken or not
+	struct wl_list pooled {};
+	struct wl_event_source *refill_idle = nullptr;
+	struct wl_list link {};
 };
 
+// A pooled connection was spawned with the caps of its set, so revoking a capability from the
+// client that owns the set takes it away from the set and from every connection it pooled
+static void cs_revoke(struct wl_client *client, int32_t capability) {
+	struct capability_set *cs;
+	wl_list_for_each(cs, &global_capabilities.capability_sets, link) {
+		if (wl_resource_get_client(cs->resource) != client) {
+			continue;
+		}
+		cs->caps.reset(capability);
+		struct client_caps *cc;
+		wl_list_for_each(cc, &cs->pooled, pool_link) {
+			api2_revoke(&global_capabilities, cc->client, capability);
+		}
+	}
+}
+
 static void cs_grant(struct wl_client *client, struct wl_resource *resource,
                      const char *capability) {
 	auto *cs = static_cast<struct capability_set *>(wl_resource_get_user_data(resource));
-	if (global_capabilities.known_caps.count(std::string(capability)) == 0) {
+	int32_t id = find_cap(capability);
+	if (id < 0) {
 		wl_resource_post_error(resource, WLDIP_CAPABILITY_SET_ERROR_NONEXISTENT_CAPABILITY,
 		                       "requested capability does not exist");
 		return;
 	}
-	if (global_capabilities.caps[client].count(std::string(capability)) == 0) {
+	if (!api2_check(&global_capabilities, client, id)) {
 		wl_resource_post_error(resource, WLDIP_CAPABILITY_SET_ERROR_DENIED_CAPABILITY,
 		                       "requested capability is not available to the current client");
 		return;
 	}
-	cs->caps.insert(std::string(capability));
+	cs->caps.set(id);
 }
 
-static void cs_spawn(struct wl_client *client, struct wl_resource *resource, uint32_t serial) {
-	auto *cs = static_cast<struct capability_set *>(wl_resource_get_user_data(resource));
+// Returns the client's end of a new connection with the given capabilities, or -1.
+// The new connection is added to pooled unless it's null
+static int spawn_connection(struct wl_client *client, const cap_bits &caps,
+                            struct wl_list *pooled) {
 	int fds[2];
 	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, &fds[0]) != 0) {
+		return -1;
+	}
+	auto *new_client = wl_client_create(wl_client_get_display(client), fds[0]);
+	if (new_client == nullptr) {
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
+	}
+	auto *cc = client_caps_ensure(new_client);
+	cc->caps = caps;
+	if (pooled != nullptr) {
+		wl_list_insert(pooled, &cc->pool_link);
+	}
+	EXTRA_DIP_TRACE(trace, EXTRA_DIP_TRACE_INFO, "spawned client",
+	                reinterpret_cast<intptr_t>(new_client), static_cast<int64_t>(caps.to_ullong()),
+	                reinterpret_cast<intptr_t>(client));
+	return fds[1];
+}
+
+static void cs_spawn(struct wl_client *client, struct wl_resource *resource, uint32_t serial) {
+	auto *cs = static_cast<struct capability_set *>(wl_resource_get_user_data(resource));
+	int fd = spawn_connection(client, cs->caps, nullptr);
+	if (fd < 0) {
 		wl_resource_post_error(resource, WLDIP_CAPABILITY_SET_ERROR_SPAWN_FAILED,
 		                       "client socket creation failed");
 		return;
 	}
-	auto *new_client = wl_client_create(wl_client_get_display(client), fds[0]);
-	global_capabilities.caps[new_client] = cs->caps;
-	weston_log("capabilities: spawned client %p with capabilities '%s' from client %p\n", new_client,
-	           join_caps(global_capabilities.caps[new_client]).c_str(), client);
-	wldip_capability_set_send_spawned(resource, serial, fds[1]);
-	close(fds[1]);
+	wldip_capability_set_send_spawned(resource, serial, fd);
+	close(fd);
+}
+
+static void cs_refill(void *data) {
+	auto *cs = static_cast<struct capability_set *>(data);
+	cs->refill_idle = nullptr;
+	struct wl_client *client = wl_resource_get_client(cs->resource);
+	for (auto &pool : cs->pools) {
+		while (pool.ready < pool.size) {
+			int fd = spawn_connection(client, cs->caps, &cs->pooled);
+			if (fd < 0) {
+				weston_log("capabilities: could not refill pool '%s'\n", pool.name.c_str());
+				break;
+			}
+			wldip_capability_set_send_pooled(cs->resource, pool.name.c_str(), fd);
+			close(fd);
+			pool.ready++;
+		}
+	}
+}
+
+// Spawning happens from an idle callback, after the requests that emptied the pools are handled
+static void cs_schedule_refill(struct capability_set *cs) {
+	if (cs->refill_idle != nullptr) {
+		return;
+	}
+	auto *loop = wl_display_get_event_loop(global_capabilities.compositor->wl_display);
+	cs->refill_idle = wl_event_loop_add_idle(loop, cs_refill, cs);
+}
+
+static void cs_keep_pool(struct wl_client *client, struct wl_resource *resource, const char *name,
+                         uint32_t size) {
+	auto *cs = static_cast<struct capability_set *>(wl_resource_get_user_data(resource));
+	size = std::min(size, cs_pool_max);
+	auto it = std::find_if(cs->pools.begin(), cs->pools.end(),
+	                       [name](const cs_pool &pool) { return pool.name == name; });
+	if (it == cs->pools.end()) {
+		// every pool keeps connections spawned, so their number is bounded too
+		if (cs->pools.size() >= cs_pools_max) {
+			wl_resource_post_error(resource, WLDIP_CAPABILITY_SET_ERROR_TOO_MANY_POOLS,
+			                       "the set already has the maximum number of pools");
+			return;
+		}
+		cs->pools.push_back(cs_pool{name, size, 0});
+	} else {
+		it->size = size;
+	}
+	cs_schedule_refill(cs);
+}
+
+static void cs_pool_take(struct wl_client *client, struct wl_resource *resource, const char *name) {
+	auto *cs = static_cast<struct capability_set *>(wl_resource_get_user_data(resource));
+	for (auto &pool : cs->pools) {
+		if (pool.name == name && pool.ready > 0) {
+			pool.ready--;
+			cs_schedule_refill(cs);
+			break;
+		}
+	}
 }
 
 static void cs_destructor(struct wl_resource *resource) {
@@ -118,19 +345,32 @@ static void cs_destructor(struct wl_resource *resource) {
 	if (cs == nullptr) {
 		return;
 	}
+	if (cs->refill_idle != nullptr) {
+		wl_event_source_remove(cs->refill_idle);
+	}
+	struct client_caps *cc, *tmp;
+	wl_list_for_each_safe(cc, tmp, &cs->pooled, pool_link) {
+		wl_list_remove(&cc->pool_link);
+		wl_list_init(&cc->pool_link);
+	}
+	wl_list_remove(&cs->link);
 	delete cs;
 }
 
 static void cs_destroy(struct wl_client *client, struct wl_resource *resource) {
-	cs_destructor(resource);
+	wl_resource_destroy(resource);
 }
 
-static const struct wldip_capability_set_interface cs_impl = {cs_grant, cs_spawn, cs_destroy};
+static const struct wldip_capability_set_interface cs_impl = {cs_grant, cs_spawn, cs_destroy,
+                                                              cs_keep_pool, cs_pool_take};
 
 static void create_capability_set(struct wl_client *client, struct wl_resource *resource,
                                   uint32_t id) {
 	auto *cs = new capability_set;
 	auto *new_resource = wl_resource_create(client, &wldip_capability_set_interface, 1, id);
+	cs->resource = new_resource;
+	wl_list_init(&cs->pooled);
+	wl_list_insert(&global_capabilities.capability_sets, &cs->link);
 	wl_resource_set_implementation(new_resource, &cs_impl, cs, cs_destructor);
 }
 
@@ -141,36 +381,36 @@ static void vip_is_down(struct wl_listener *listener, void *data) {
 	weston_compositor_exit(global_capabilities.compositor);
 }
 
-static void normal_client_is_down(struct wl_listener *listener, void *data) {
-	weston_log("capabilities: cleanup client %p\n", data);
-	global_capabilities.caps.erase(reinterpret_cast<struct wl_client *>(data));
-	wl_list_remove(&listener->link);
-	delete listener;
-}
-
 static void bind_caps(struct wl_client *client, void *data, uint32_t version, uint32_t id) {
 	auto *resource = wl_resource_create(client, &wldip_capabilities_interface, 1, id);
 	if (!global_capabilities.first_client_arrived) {
 		global_capabilities.first_client_arrived = true;
-		global_capabilities.caps[client] = global_capabilities.known_caps;
+		auto *cc = client_caps_ensure(client);
+		for (size_t i = 0; i < global_capabilities.known_caps.size(); i++) {
+			cc->caps.set(i);
+		}
 		global_capabilities.vip_destroy_listener.notify = vip_is_down;
 		wl_client_add_destroy_listener(client, &global_capabilities.vip_destroy_listener);
 		weston_log(
 		    "capabilities: first client %p arrived, granted capabilities '%s', considered as "
 		    "important\n",
-		    client, join_caps(global_capabilities.caps[client]).c_str());
+		    client, join_caps(cc->caps).c_str());
 	}
-	auto *destroy_listener = new wl_listener{.notify = normal_client_is_down};
-	wl_client_add_destroy_listener(client, destroy_listener);
 	wl_resource_set_implementation(resource, &impl, data, nullptr);
 }
 
 WL_EXPORT int wet_module_init(struct weston_compositor *compositor, int *argc, char *argv[]) {
 	global_capabilities.compositor = compositor;
+	wl_list_init(&global_capabilities.capability_sets);
+	extra_dip_trace_init(compositor, &trace, EXTRA_DIP_TRACE_API_NAME("capabilities"));
 	if (weston_plugin_api_register(compositor, WESTON_EXTRA_DIP_CAPABILITIES_API_NAME, &api,
 	                               sizeof(api)) < 0) {
 		return -1;
 	}
+	if (weston_plugin_api_register(compositor, WESTON_EXTRA_DIP_CAPABILITIES_API_V2_NAME, &api_v2,
+	                               sizeof(api_v2)) < 0) {
+		return -1;
+	}
 	wl_global_create(compositor->wl_display, &wldip_capabilities_interface, 1, nullptr, bind_caps);
 	return 0;
 }
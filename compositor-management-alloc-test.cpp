@@ -0,0 +1,29 @@
+#include <cstdio>
+#include "compositor-management-fake.h"
+
+#include <unistd.h>
+
+// The first update grows the snapshot, builder and scratch vectors, after that the heap must not
+// be touched by capturing, serializing or writing an update
+
+static const int steady_updates = 100;
+
+static bool check(size_t n_surfaces) {
+	auto *fake = new fake_compositor(8, 4, 3, 60, n_surfaces);
+	close(fake->ctx->make_update());
+	uint64_t allocs_before = allocations;
+	for (int i = 0; i < steady_updates; i++) {
+		close(fake->ctx->make_update());
+	}
+	uint64_t allocs = allocations - allocs_before;
+	printf("%zu surfaces: %llu allocations in %d updates\n", n_surfaces,
+	       static_cast<unsigned long long>(allocs), steady_updates);
+	// the context has a worker thread, the fake is left to the process exit like in the benchmark
+	return allocs == 0;
+}
+
+int main() {
+	bool ok = check(200);
+	ok = check(2000) && ok;
+	return ok ? 0 : 1;
+}
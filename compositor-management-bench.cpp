@@ -0,0 +1,65 @@
+#include <benchmark/benchmark.h>
+#include <memory>
+#include <unordered_map>
+#include "compositor-management-fake.h"
+
+// 8 heads, 4 outputs, 3 seats with 60 input devices in total, surfaces from the argument.
+// google-benchmark calls each function several times per argument, every context has a worker
+// thread and an eventfd, so one fake is built per size and shared for the whole run
+static fake_compositor *make_fake(const benchmark::State &state) {
+	static std::unordered_map<int64_t, std::unique_ptr<fake_compositor>> fakes;
+	auto &fake = fakes[state.range(0)];
+	if (!fake) {
+		fake.reset(new fake_compositor(8, 4, 3, 60, state.range(0)));
+	}
+	return fake.get();
+}
+
+// Allocations are reported for reference, compositor-management-alloc-test is what fails when a
+// steady state update touches the heap
+static void report(benchmark::State &state, fake_compositor *fake, uint64_t allocs) {
+	state.counters["allocs_per_update"] =
+	    benchmark::Counter(static_cast<double>(allocs), benchmark::Counter::kAvgIterations);
+	state.counters["bytes_per_update"] =
+	    static_cast<double>(fake->ctx->local_serializer.builder.GetSize());
+}
+
+// What the compositor thread pays per update
+static void BM_capture_state(benchmark::State &state) {
+	auto *fake = make_fake(state);
+	close(fake->ctx->make_update());
+	uint64_t allocs_before = allocations;
+	for (auto _ : state) {
+		fake->ctx->capture_state(fake->ctx->local_snapshot);
+		benchmark::DoNotOptimize(fake->ctx->local_snapshot.strings.data());
+	}
+	report(state, fake, allocations - allocs_before);
+}
+BENCHMARK(BM_capture_state)->Arg(200)->Arg(2000);
+
+// What the worker thread pays per update, minus the shared memory write
+static void BM_serialize(benchmark::State &state) {
+	auto *fake = make_fake(state);
+	close(fake->ctx->make_update());
+	uint64_t allocs_before = allocations;
+	for (auto _ : state) {
+		fake->ctx->local_serializer.serialize(fake->ctx->local_snapshot);
+		benchmark::DoNotOptimize(fake->ctx->local_serializer.builder.GetBufferPointer());
+	}
+	report(state, fake, allocations - allocs_before);
+}
+BENCHMARK(BM_serialize)->Arg(200)->Arg(2000);
+
+// Capture, serialization and writing the result into a shared memory fd
+static void BM_make_update(benchmark::State &state) {
+	auto *fake = make_fake(state);
+	close(fake->ctx->make_update());
+	uint64_t allocs_before = allocations;
+	for (auto _ : state) {
+		close(fake->ctx->make_update());
+	}
+	report(state, fake, allocations - allocs_before);
+}
+BENCHMARK(BM_make_update)->Arg(200)->Arg(2000);
+
+BENCHMARK_MAIN();
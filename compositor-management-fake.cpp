@@ -0,0 +1,351 @@
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include "compositor-management-fake.h"
+
+extern "C" {
+#include <libinput.h>
+#include <libweston-desktop.h>
+}
+
+// Per thread, so that the context's worker thread doesn't race with the counting thread
+thread_local uint64_t allocations = 0;
+
+void *operator new(size_t size) {
+	allocations++;
+	void *ptr = malloc(size);
+	if (ptr == nullptr) {
+		abort();
+	}
+	return ptr;
+}
+
+void operator delete(void *ptr) noexcept { free(ptr); }
+
+void operator delete(void *ptr, size_t size) noexcept { free(ptr); }
+
+// Everything the plugin calls in libinput and libweston-desktop
+
+extern "C" {
+int libinput_device_get_size(struct libinput_device *device, double *width, double *height) {
+	*width = 100;
+	*height = 60;
+	return 0;
+}
+unsigned int libinput_device_get_id_product(struct libinput_device *device) {
+	return device->product;
+}
+unsigned int libinput_device_get_id_vendor(struct libinput_device *device) {
+	return device->vendor;
+}
+const char *libinput_device_get_name(struct libinput_device *device) {
+	return device->name.c_str();
+}
+const char *libinput_device_get_sysname(struct libinput_device *device) {
+	return device->sysname.c_str();
+}
+int libinput_device_has_capability(struct libinput_device *device,
+                                   enum libinput_device_capability capability) {
+	return static_cast<int>(capability == LIBINPUT_DEVICE_CAP_POINTER);
+}
+int libinput_device_touch_get_touch_count(struct libinput_device *device) { return 0; }
+int libinput_device_config_tap_get_finger_count(struct libinput_device *device) { return 3; }
+enum libinput_config_tap_state libinput_device_config_tap_get_enabled(
+    struct libinput_device *device) {
+	return LIBINPUT_CONFIG_TAP_ENABLED;
+}
+enum libinput_config_tap_state libinput_device_config_tap_get_default_enabled(
+    struct libinput_device *device) {
+	return LIBINPUT_CONFIG_TAP_DISABLED;
+}
+enum libinput_config_tap_button_map libinput_device_config_tap_get_button_map(
+    struct libinput_device *device) {
+	return LIBINPUT_CONFIG_TAP_MAP_LRM;
+}
+enum libinput_config_tap_button_map libinput_device_config_tap_get_default_button_map(
+    struct libinput_device *device) {
+	return LIBINPUT_CONFIG_TAP_MAP_LRM;
+}
+enum libinput_config_drag_state libinput_device_config_tap_get_drag_enabled(
+    struct libinput_device *device) {
+	return LIBINPUT_CONFIG_DRAG_ENABLED;
+}
+enum libinput_config_drag_state libinput_device_config_tap_get_default_drag_enabled(
+    struct libinput_device *device) {
+	return LIBINPUT_CONFIG_DRAG_ENABLED;
+}
+enum libinput_config_drag_lock_state libinput_device_config_tap_get_drag_lock_enabled(
+    struct libinput_device *device) {
+	return LIBINPUT_CONFIG_DRAG_LOCK_DISABLED;
+}
+enum libinput_config_drag_lock_state libinput_device_config_tap_get_default_drag_lock_enabled(
+    struct libinput_device *device) {
+	return LIBINPUT_CONFIG_DRAG_LOCK_DISABLED;
+}
+uint32_t libinput_device_config_send_events_get_mode(struct libinput_device *device) {
+	return LIBINPUT_CONFIG_SEND_EVENTS_ENABLED;
+}
+uint32_t libinput_device_config_send_events_get_default_mode(struct libinput_device *device) {
+	return LIBINPUT_CONFIG_SEND_EVENTS_ENABLED;
+}
+double libinput_device_config_accel_get_speed(struct libinput_device *device) { return 0.3; }
+double libinput_device_config_accel_get_default_speed(struct libinput_device *device) { return 0; }
+enum libinput_config_accel_profile libinput_device_config_accel_get_profile(
+    struct libinput_device *device) {
+	return LIBINPUT_CONFIG_ACCEL_PROFILE_ADAPTIVE;
+}
+enum libinput_config_accel_profile libinput_device_config_accel_get_default_profile(
+    struct libinput_device *device) {
+	return LIBINPUT_CONFIG_ACCEL_PROFILE_ADAPTIVE;
+}
+int libinput_device_config_scroll_has_natural_scroll(struct libinput_device *device) { return 1; }
+int libinput_device_config_scroll_get_natural_scroll_enabled(struct libinput_device *device) {
+	return 1;
+}
+int libinput_device_config_scroll_get_default_natural_scroll_enabled(
+    struct libinput_device *device) {
+	return 0;
+}
+int libinput_device_config_left_handed_is_available(struct libinput_device *device) { return 1; }
+int libinput_device_config_left_handed_get(struct libinput_device *device) { return 0; }
+int libinput_device_config_left_handed_get_default(struct libinput_device *device) { return 0; }
+uint32_t libinput_device_config_click_get_methods(struct libinput_device *device) {
+	return LIBINPUT_CONFIG_CLICK_METHOD_BUTTON_AREAS | LIBINPUT_CONFIG_CLICK_METHOD_CLICKFINGER;
+}
+enum libinput_config_click_method libinput_device_config_click_get_method(
+    struct libinput_device *device) {
+	return LIBINPUT_CONFIG_CLICK_METHOD_CLICKFINGER;
+}
+enum libinput_config_click_method libinput_device_config_click_get_default_method(
+    struct libinput_device *device) {
+	return LIBINPUT_CONFIG_CLICK_METHOD_BUTTON_AREAS;
+}
+int libinput_device_config_middle_emulation_is_available(struct libinput_device *device) {
+	return 1;
+}
+enum libinput_config_middle_emulation_state libinput_device_config_middle_emulation_get_enabled(
+    struct libinput_device *device) {
+	return LIBINPUT_CONFIG_MIDDLE_EMULATION_DISABLED;
+}
+enum libinput_config_middle_emulation_state
+libinput_device_config_middle_emulation_get_default_enabled(struct libinput_device *device) {
+	return LIBINPUT_CONFIG_MIDDLE_EMULATION_DISABLED;
+}
+uint32_t libinput_device_config_scroll_get_methods(struct libinput_device *device) {
+	return LIBINPUT_CONFIG_SCROLL_2FG | LIBINPUT_CONFIG_SCROLL_EDGE;
+}
+enum libinput_config_scroll_method libinput_device_config_scroll_get_method(
+    struct libinput_device *device) {
+	return LIBINPUT_CONFIG_SCROLL_2FG;
+}
+enum libinput_config_scroll_method libinput_device_config_scroll_get_default_method(
+    struct libinput_device *device) {
+	return LIBINPUT_CONFIG_SCROLL_2FG;
+}
+uint32_t libinput_device_config_scroll_get_button(struct libinput_device *device) { return 0; }
+uint32_t libinput_device_config_scroll_get_default_button(struct libinput_device *device) {
+	return 0;
+}
+int libinput_device_config_dwt_is_available(struct libinput_device *device) { return 1; }
+enum libinput_config_dwt_state libinput_device_config_dwt_get_enabled(
+    struct libinput_device *device) {
+	return LIBINPUT_CONFIG_DWT_ENABLED;
+}
+enum libinput_config_dwt_state libinput_device_config_dwt_get_default_enabled(
+    struct libinput_device *device) {
+	return LIBINPUT_CONFIG_DWT_ENABLED;
+}
+int libinput_device_config_rotation_is_available(struct libinput_device *device) { return 0; }
+unsigned int libinput_device_config_rotation_get_angle(struct libinput_device *device) {
+	return 0;
+}
+unsigned int libinput_device_config_rotation_get_default_angle(struct libinput_device *device) {
+	return 0;
+}
+
+// setters are only referenced by the request handlers
+enum libinput_config_status libinput_device_config_tap_set_enabled(
+    struct libinput_device *device, enum libinput_config_tap_state enable) {
+	return LIBINPUT_CONFIG_STATUS_UNSUPPORTED;
+}
+enum libinput_config_status libinput_device_config_tap_set_drag_enabled(
+    struct libinput_device *device, enum libinput_config_drag_state enable) {
+	return LIBINPUT_CONFIG_STATUS_UNSUPPORTED;
+}
+enum libinput_config_status libinput_device_config_tap_set_drag_lock_enabled(
+    struct libinput_device *device, enum libinput_config_drag_lock_state enable) {
+	return LIBINPUT_CONFIG_STATUS_UNSUPPORTED;
+}
+enum libinput_config_status libinput_device_config_send_events_set_mode(
+    struct libinput_device *device, uint32_t mode) {
+	return LIBINPUT_CONFIG_STATUS_UNSUPPORTED;
+}
+enum libinput_config_status libinput_device_config_accel_set_speed(struct libinput_device *device,
+                                                                   double speed) {
+	return LIBINPUT_CONFIG_STATUS_UNSUPPORTED;
+}
+enum libinput_config_status libinput_device_config_accel_set_profile(
+    struct libinput_device *device, enum libinput_config_accel_profile profile) {
+	return LIBINPUT_CONFIG_STATUS_UNSUPPORTED;
+}
+enum libinput_config_status libinput_device_config_scroll_set_natural_scroll_enabled(
+    struct libinput_device *device, int enable) {
+	return LIBINPUT_CONFIG_STATUS_UNSUPPORTED;
+}
+enum libinput_config_status libinput_device_config_left_handed_set(struct libinput_device *device,
+                                                                   int left_handed) {
+	return LIBINPUT_CONFIG_STATUS_UNSUPPORTED;
+}
+enum libinput_config_status libinput_device_config_click_set_method(
+    struct libinput_device *device, enum libinput_config_click_method method) {
+	return LIBINPUT_CONFIG_STATUS_UNSUPPORTED;
+}
+enum libinput_config_status libinput_device_config_scroll_set_method(
+    struct libinput_device *device, enum libinput_config_scroll_method method) {
+	return LIBINPUT_CONFIG_STATUS_UNSUPPORTED;
+}
+enum libinput_config_status libinput_device_config_middle_emulation_set_enabled(
+    struct libinput_device *device, enum libinput_config_middle_emulation_state enable) {
+	return LIBINPUT_CONFIG_STATUS_UNSUPPORTED;
+}
+enum libinput_config_status libinput_device_config_dwt_set_enabled(
+    struct libinput_device *device, enum libinput_config_dwt_state enable) {
+	return LIBINPUT_CONFIG_STATUS_UNSUPPORTED;
+}
+
+bool weston_surface_is_desktop_surface(struct weston_surface *surface) {
+	return surface->committed_private != nullptr;
+}
+struct weston_desktop_surface *weston_surface_get_desktop_surface(struct weston_surface *surface) {
+	return static_cast<struct weston_desktop_surface *>(surface->committed_private);
+}
+const char *weston_desktop_surface_get_title(struct weston_desktop_surface *surface) {
+	return surface->title.c_str();
+}
+const char *weston_desktop_surface_get_app_id(struct weston_desktop_surface *surface) {
+	return surface->app_id.c_str();
+}
+pid_t weston_desktop_surface_get_pid(struct weston_desktop_surface *surface) {
+	return surface->pid;
+}
+struct weston_desktop_client *weston_desktop_surface_get_client(
+    struct weston_desktop_surface *surface) {
+	return nullptr;
+}
+int weston_desktop_client_ping(struct weston_desktop_client *client) { return -1; }
+bool weston_desktop_surface_get_activated(struct weston_desktop_surface *surface) { return false; }
+bool weston_desktop_surface_get_maximized(struct weston_desktop_surface *surface) { return false; }
+bool weston_desktop_surface_get_fullscreen(struct weston_desktop_surface *surface) { return false; }
+bool weston_desktop_surface_get_resizing(struct weston_desktop_surface *surface) { return false; }
+struct weston_size weston_desktop_surface_get_max_size(struct weston_desktop_surface *surface) {
+	return {0, 0};
+}
+struct weston_size weston_desktop_surface_get_min_size(struct weston_desktop_surface *surface) {
+	return {0, 0};
+}
+}
+
+static int fake_get_label(struct weston_surface *surface, char *buf, size_t len) {
+	return snprintf(buf, len, "fake surface %p", static_cast<void *>(surface));
+}
+
+fake_compositor::fake_compositor(size_t n_heads, size_t n_outputs, size_t n_seats,
+                                 size_t n_devices, size_t n_surfaces)
+    : heads(n_heads),
+      head_names(n_heads),
+      outputs(n_outputs),
+      output_names(n_outputs),
+      seats(n_seats),
+      seat_names(n_seats),
+      input_devices(n_devices),
+      evdev_devices(n_devices),
+      surfaces(n_surfaces),
+      desktop_surfaces(n_surfaces),
+      views(n_surfaces) {
+	compositor.wl_display = wl_display_create();
+	compositor.kb_repeat_rate = 40;
+	compositor.kb_repeat_delay = 400;
+	wl_list_init(&compositor.plugin_api_list);
+	wl_list_init(&compositor.head_list);
+	wl_list_init(&compositor.output_list);
+	wl_list_init(&compositor.seat_list);
+	wl_list_init(&compositor.view_list);
+	wl_signal_init(&compositor.create_surface_signal);
+	wl_signal_init(&compositor.activate_signal);
+	wl_signal_init(&compositor.output_created_signal);
+	wl_signal_init(&compositor.output_destroyed_signal);
+	wl_signal_init(&compositor.output_moved_signal);
+	wl_signal_init(&compositor.output_resized_signal);
+	wl_signal_init(&compositor.output_heads_changed_signal);
+	wl_signal_init(&compositor.input_devices_changed_signal);
+	wl_signal_init(&compositor.destroy_signal);
+	// the plugin only enumerates input devices on the DRM backend
+	weston_plugin_api_register(&compositor, WESTON_DRM_VIRTUAL_OUTPUT_API_NAME, &drm_api,
+	                           sizeof(drm_api));
+
+	for (size_t i = 0; i < outputs.size(); i++) {
+		auto &output = outputs[i];
+		output_names[i] = "OUT-" + std::to_string(i);
+		output.id = i;
+		output.name = &output_names[i][0];
+		output.compositor = &compositor;
+		output.x = 1920 * i;
+		output.width = 1920;
+		output.height = 1080;
+		output.current_scale = output.original_scale = 1;
+		wl_signal_init(&output.frame_signal);
+		wl_list_insert(compositor.output_list.prev, &output.link);
+	}
+
+	for (size_t i = 0; i < heads.size(); i++) {
+		auto &head = heads[i];
+		head_names[i] = "HEAD-" + std::to_string(i);
+		head.name = &head_names[i][0];
+		head.make = const_cast<char *>("Fake");
+		head.model = const_cast<char *>("Monitor 3000");
+		head.serial_number = const_cast<char *>("0123456789");
+		head.output = outputs.empty() ? nullptr : &outputs[i % outputs.size()];
+		head.connected = true;
+		wl_list_insert(compositor.head_list.prev, &head.compositor_link);
+	}
+
+	for (size_t i = 0; i < seats.size(); i++) {
+		auto &seat = seats[i];
+		seat_names[i] = "seat" + std::to_string(i);
+		seat.base.seat_name = &seat_names[i][0];
+		wl_list_init(&seat.devices_list);
+		wl_list_insert(compositor.seat_list.prev, &seat.base.link);
+	}
+
+	for (size_t i = 0; i < input_devices.size(); i++) {
+		input_devices[i].name = "Fake Input Device " + std::to_string(i);
+		input_devices[i].sysname = "event" + std::to_string(i);
+		input_devices[i].vendor = 0x046d;
+		input_devices[i].product = i;
+		evdev_devices[i].device = &input_devices[i];
+		if (!seats.empty()) {
+			wl_list_insert(seats[i % seats.size()].devices_list.prev, &evdev_devices[i].link);
+		}
+	}
+
+	for (size_t i = 0; i < surfaces.size(); i++) {
+		auto &surface = surfaces[i];
+		surface.compositor = &compositor;
+		surface.get_label = fake_get_label;
+		wl_signal_init(&surface.destroy_signal);
+		surface.output = outputs.empty() ? nullptr : &outputs[i % outputs.size()];
+		if (i % 2 == 0) {
+			surface.role_name = "xdg_toplevel";
+			desktop_surfaces[i].title = "Window number " + std::to_string(i);
+			desktop_surfaces[i].app_id = "org.example.App" + std::to_string(i % 16);
+			desktop_surfaces[i].pid = 1000 + i % 16;
+			surface.committed_private = &desktop_surfaces[i];
+		} else {
+			surface.role_name = i % 10 == 1 ? "layer-shell" : "wl_subsurface";
+		}
+		views[i].surface = &surface;
+		wl_list_insert(compositor.view_list.prev, &views[i].link);
+	}
+
+	ctx = new cm_context(&compositor);
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "compositor-management.h"
+
+extern "C" {
+#include <compositor-drm.h>
+#include <compositor.h>
+#include <libinput-device.h>
+#include <libinput-seat.h>
+}
+
+// Heap allocations made by the current thread, counted by the operator new that replaces the
+// global one in every executable linking the fakes
+extern thread_local uint64_t allocations;
+
+// libinput and libweston-desktop are not linked, the plugin only sees these fakes
+struct libinput_device {
+	std::string name;
+	std::string sysname;
+	unsigned int vendor, product;
+};
+
+struct weston_desktop_surface {
+	std::string title;
+	std::string app_id;
+	pid_t pid;
+};
+
+// A compositor state with the given number of objects and a compositor-management context
+// on it. Only what the plugin reads while capturing and serializing the state is set up
+struct fake_compositor {
+	struct weston_compositor compositor {};
+	struct weston_drm_virtual_output_api drm_api {};
+	std::vector<struct weston_head> heads;
+	std::vector<std::string> head_names;
+	std::vector<struct weston_output> outputs;
+	std::vector<std::string> output_names;
+	std::vector<struct udev_seat> seats;
+	std::vector<std::string> seat_names;
+	std::vector<struct libinput_device> input_devices;
+	std::vector<struct evdev_device> evdev_devices;
+	std::vector<struct weston_surface> surfaces;
+	std::vector<struct weston_desktop_surface> desktop_surfaces;
+	std::vector<struct weston_view> views;
+	cm_context *ctx = nullptr;
+
+	fake_compositor(size_t n_heads, size_t n_outputs, size_t n_seats, size_t n_devices,
+	                size_t n_surfaces);
+
+	fake_compositor(fake_compositor &&) = delete;
+};
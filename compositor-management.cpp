@@ -1,8 +1,8 @@
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
-#include <memory>
-#include <unordered_set>
-#include <vector>
-#include "Management_generated.h"
+#include "compositor-management.h"
 
 extern "C" {
 #include <compositor-drm.h>
@@ -12,9 +12,13 @@ extern "C" {
 #include <libinput-device.h>
 #include <libinput-seat.h>
 #include <libweston-desktop.h>
+#include <signal.h>
+#include <sys/eventfd.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include "weston-extra-dip-capabilities-api.h"
 #include "wldip-compositor-manager-server-protocol.h"
 
 static void on_create_surface(struct wl_listener *listener, void *data);
@@ -25,335 +29,1215 @@ static void on_output_moved(struct wl_listener *listener, void *data);
 static void on_output_resized(struct wl_listener *listener, void *data);
 static void on_output_heads_changed(struct wl_listener *listener, void *data);
 static void on_input_devices_changed(struct wl_listener *listener, void *data);
+static void on_output_frame(struct wl_listener *listener, void *data);
+static int on_stats_timer(void *data);
+static int on_ping_timer(void *data);
+static void on_client_created(struct wl_listener *listener, void *data);
+static void on_client_destroyed(struct wl_listener *listener, void *data);
+static void on_resource_created(struct wl_listener *listener, void *data);
+static void on_resource_destroyed(struct wl_listener *listener, void *data);
+static void on_protocol_message(void *user_data, enum wl_protocol_logger_type direction,
+                                const struct wl_protocol_logger_message *message);
+static void on_inspect_buffers(void *data);
+static void on_surface_destroyed(struct wl_listener *listener, void *data);
+static void on_surfaces_idle(void *data);
+static int on_worker_done(int fd, uint32_t mask, void *data);
+static void on_compositor_destroy(struct wl_listener *listener, void *data);
 
-struct cm_context {
-	struct weston_compositor *compositor;
-	const struct weston_desktop_shell_api *desk_shell;
-	std::unordered_set<wl_resource *> surfaces_subscribers;
-	std::unordered_set<wl_resource *> outputs_subscribers;
-	std::unordered_set<wl_resource *> inputdevs_subscribers;
-	struct wl_listener create_surface_listener {};
-	struct wl_listener activate_listener {};
-	struct wl_listener output_created_listener {};
-	struct wl_listener output_destroyed_listener {};
-	struct wl_listener output_moved_listener {};
-	struct wl_listener output_resized_listener {};
-	struct wl_listener output_heads_changed_listener {};
-	struct wl_listener input_devices_changed_listener {};
-
-	cm_context(struct weston_compositor *c) : compositor(c) {
-		desk_shell = weston_desktop_shell_get_api(c);
-		create_surface_listener.notify = on_create_surface;
-		wl_signal_add(&c->create_surface_signal, &create_surface_listener);
-		activate_listener.notify = on_activate;
-		wl_signal_add(&c->activate_signal, &activate_listener);
-		output_created_listener.notify = on_output_created;
-		wl_signal_add(&c->output_created_signal, &output_created_listener);
-		output_destroyed_listener.notify = on_output_destroyed;
-		wl_signal_add(&c->output_destroyed_signal, &output_destroyed_listener);
-		output_moved_listener.notify = on_output_moved;
-		wl_signal_add(&c->output_moved_signal, &output_moved_listener);
-		output_resized_listener.notify = on_output_resized;
-		wl_signal_add(&c->output_resized_signal, &output_resized_listener);
-		output_heads_changed_listener.notify = on_output_heads_changed;
-		wl_signal_add(&c->output_heads_changed_signal, &output_heads_changed_listener);
-		input_devices_changed_listener.notify = on_input_devices_changed;
-		wl_signal_add(&c->input_devices_changed_signal, &input_devices_changed_listener);
-	}
-
-	int make_update() {
-		using namespace wldip::compositor_management;
-		flatbuffers::FlatBufferBuilder builder(4096);
-
-		std::vector<flatbuffers::Offset<Head>> fheads;
-		struct weston_head *head;
-		wl_list_for_each(head, &compositor->head_list, compositor_link) {
-			const char *name = head->name != nullptr ? head->name : "";
-			const char *make = head->make != nullptr ? head->make : "";
-			const char *model = head->model != nullptr ? head->model : "";
-			const char *serial_number = head->serial_number != nullptr ? head->serial_number : "";
-			fheads.push_back(CreateHead(
-			    builder, builder.CreateString(name), head->output != nullptr ? head->output->id : -1,
-			    head->mm_width, head->mm_height, builder.CreateString(make), builder.CreateString(model),
-			    builder.CreateString(serial_number), head->subpixel, head->connection_internal,
-			    head->connected, head->non_desktop));
-		}
-
-		std::vector<flatbuffers::Offset<Output>> foutputs;
-		struct weston_output *output;
-		wl_list_for_each(output, &compositor->output_list, link) {
-			const char *name = output->name != nullptr ? output->name : "";
-			foutputs.push_back(CreateOutput(builder, output->id, builder.CreateString(name), output->x,
-			                                output->y, output->width, output->height,
-			                                output->current_scale, output->original_scale));
-		}
-
-		std::vector<flatbuffers::Offset<Seat>> fseats;
-		struct weston_seat *seat;
-		wl_list_for_each(seat, &compositor->seat_list, link) {
-			std::vector<flatbuffers::Offset<InputDevice>> finputs;
-			// TODO: support fbdev/scfb
-			if (weston_drm_virtual_output_get_api(compositor) != nullptr) {
-				auto *useat = reinterpret_cast<udev_seat *>(seat);
-				struct evdev_device *device;
-				wl_list_for_each(device, &useat->devices_list, link) {
-					double width, height;
-					libinput_device_get_size(device->device, &width, &height);
-					int finger_count = libinput_device_config_tap_get_finger_count(device->device);
-					std::vector<uint32_t> click_methods;
-					uint32_t cmethods = libinput_device_config_scroll_get_methods(device->device);
-					if ((cmethods & LIBINPUT_CONFIG_CLICK_METHOD_NONE) != 0u) {
-						click_methods.push_back(ClickMethod_None);
-					}
-					if ((cmethods & LIBINPUT_CONFIG_CLICK_METHOD_BUTTON_AREAS) != 0u) {
-						click_methods.push_back(ClickMethod_ButtonAreas);
-					}
-					if ((cmethods & LIBINPUT_CONFIG_CLICK_METHOD_CLICKFINGER) != 0u) {
-						click_methods.push_back(ClickMethod_ClickFinger);
-					}
-					std::vector<uint32_t> scroll_methods;
-					uint32_t smethods = libinput_device_config_scroll_get_methods(device->device);
-					if ((smethods & LIBINPUT_CONFIG_SCROLL_NO_SCROLL) != 0u) {
-						scroll_methods.push_back(ScrollMethod_None);
-					}
-					if ((smethods & LIBINPUT_CONFIG_SCROLL_2FG) != 0u) {
-						scroll_methods.push_back(ScrollMethod_TwoFingers);
-					}
-					if ((smethods & LIBINPUT_CONFIG_SCROLL_EDGE) != 0u) {
-						scroll_methods.push_back(ScrollMethod_Edge);
-					}
-					if ((smethods & LIBINPUT_CONFIG_SCROLL_ON_BUTTON_DOWN) != 0u) {
-						scroll_methods.push_back(ScrollMethod_OnButtonDown);
-					}
-					std::vector<uint8_t> capabilities;
-					if (libinput_device_has_capability(device->device, LIBINPUT_DEVICE_CAP_KEYBOARD) != 0) {
-						capabilities.push_back(DeviceCapability_Keyboard);
-					}
-					if (libinput_device_has_capability(device->device, LIBINPUT_DEVICE_CAP_POINTER) != 0) {
-						capabilities.push_back(DeviceCapability_Pointer);
-					}
-					if (libinput_device_has_capability(device->device, LIBINPUT_DEVICE_CAP_TOUCH) != 0) {
-						capabilities.push_back(DeviceCapability_Touch);
-					}
-					if (libinput_device_has_capability(device->device, LIBINPUT_DEVICE_CAP_TABLET_TOOL) !=
-					    0) {
-						capabilities.push_back(DeviceCapability_TabletTool);
-					}
-					if (libinput_device_has_capability(device->device, LIBINPUT_DEVICE_CAP_TABLET_PAD) != 0) {
-						capabilities.push_back(DeviceCapability_TabletPad);
-					}
-					if (libinput_device_has_capability(device->device, LIBINPUT_DEVICE_CAP_GESTURE) != 0) {
-						capabilities.push_back(DeviceCapability_Gesture);
-					}
-					if (libinput_device_has_capability(device->device, LIBINPUT_DEVICE_CAP_SWITCH) != 0) {
-						capabilities.push_back(DeviceCapability_Switch);
-					}
-					finputs.push_back(CreateInputDevice(
-					    builder, libinput_device_get_id_product(device->device),
-					    libinput_device_get_id_vendor(device->device), width, height,
-					    libinput_device_touch_get_touch_count(device->device), finger_count,
-					    libinput_device_config_tap_get_default_enabled(device->device) != 0u,
-					    libinput_device_config_tap_get_enabled(device->device) != 0u,
-					    finger_count == 0 ? TapButtonMap_MIN
-					                      : static_cast<TapButtonMap>(
-					                            libinput_device_config_tap_get_button_map(device->device)),
-					    finger_count == 0
-					        ? TapButtonMap_MIN
-					        : static_cast<TapButtonMap>(
-					              libinput_device_config_tap_get_default_button_map(device->device)),
-					    libinput_device_config_tap_get_default_drag_enabled(device->device) != 0u,
-					    libinput_device_config_tap_get_drag_enabled(device->device) != 0u,
-					    libinput_device_config_tap_get_default_drag_lock_enabled(device->device) != 0u,
-					    libinput_device_config_tap_get_drag_lock_enabled(device->device) != 0u,
-					    static_cast<SendEventsMode>(
-					        libinput_device_config_send_events_get_default_mode(device->device)),
-					    static_cast<SendEventsMode>(
-					        libinput_device_config_send_events_get_mode(device->device)),
-					    libinput_device_config_accel_get_default_speed(device->device),
-					    libinput_device_config_accel_get_speed(device->device),
-					    static_cast<AccelerationProfile>(
-					        libinput_device_config_accel_get_default_profile(device->device)),
-					    static_cast<AccelerationProfile>(
-					        libinput_device_config_accel_get_profile(device->device)),
-					    libinput_device_config_scroll_has_natural_scroll(device->device) != 0,
-					    libinput_device_config_scroll_get_default_natural_scroll_enabled(device->device) != 0,
-					    libinput_device_config_scroll_get_natural_scroll_enabled(device->device) != 0,
-					    libinput_device_config_left_handed_is_available(device->device) != 0,
-					    libinput_device_config_left_handed_get_default(device->device) != 0,
-					    libinput_device_config_left_handed_get(device->device) != 0,
-					    builder.CreateVector(click_methods),
-					    static_cast<ClickMethod>(
-					        libinput_device_config_click_get_default_method(device->device)),
-					    static_cast<ClickMethod>(libinput_device_config_click_get_method(device->device)),
-					    libinput_device_config_middle_emulation_is_available(device->device) != 0,
-					    libinput_device_config_middle_emulation_get_default_enabled(device->device) != 0u,
-					    libinput_device_config_middle_emulation_get_enabled(device->device) != 0u,
-					    builder.CreateVector(scroll_methods),
-					    static_cast<ScrollMethod>(
-					        libinput_device_config_scroll_get_default_method(device->device)),
-					    static_cast<ScrollMethod>(libinput_device_config_scroll_get_method(device->device)),
-					    libinput_device_config_scroll_get_default_button(device->device),
-					    libinput_device_config_scroll_get_button(device->device),
-					    libinput_device_config_dwt_is_available(device->device) != 0,
-					    libinput_device_config_dwt_get_default_enabled(device->device) != 0u,
-					    libinput_device_config_dwt_get_enabled(device->device) != 0u,
-					    libinput_device_config_rotation_is_available(device->device) != 0,
-					    libinput_device_config_rotation_get_default_angle(device->device),
-					    libinput_device_config_rotation_get_angle(device->device),
-					    builder.CreateVector(capabilities),
-					    builder.CreateString(libinput_device_get_name(
-					        device->device)),  // libinput promises to never return NULL
-					    builder.CreateString(libinput_device_get_sysname(device->device))));
-				}
-			}
-			fseats.push_back(CreateSeat(builder, builder.CreateString(seat->seat_name),
-			                            builder.CreateVector(finputs)));
-		}
-
-		std::vector<flatbuffers::Offset<Surface>> fsurfaces;
-		std::unordered_set<struct weston_surface *> surfaces;
-		struct weston_view *view;
-		wl_list_for_each(view, &compositor->view_list, link) { surfaces.insert(view->surface); }
-		for (const auto surface : surfaces) {
-			flatbuffers::Offset<DesktopSurface> dsurfo = 0;
-			if (weston_surface_is_desktop_surface(surface)) {
-				auto dsurf = weston_surface_get_desktop_surface(surface);
-				const char *titlestr = weston_desktop_surface_get_title(dsurf);
-				auto titlestro = builder.CreateString(titlestr != nullptr ? titlestr : "");
-				const char *appidstr = weston_desktop_surface_get_app_id(dsurf);
-				auto appidstro = builder.CreateString(appidstr != nullptr ? appidstr : "");
-				DesktopSurfaceBuilder dsurfb(builder);
-				dsurfb.add_title(titlestro);
-				dsurfb.add_app_id(appidstro);
-				dsurfb.add_pid(weston_desktop_surface_get_pid(dsurf));
-				dsurfb.add_activated(weston_desktop_surface_get_activated(dsurf));
-				dsurfb.add_maximized(weston_desktop_surface_get_maximized(dsurf));
-				dsurfb.add_fullscreen(weston_desktop_surface_get_fullscreen(dsurf));
-				dsurfb.add_resizing(weston_desktop_surface_get_resizing(dsurf));
-				auto max_size = weston_desktop_surface_get_max_size(dsurf);
-				dsurfb.add_max_width(max_size.width);
-				dsurfb.add_max_height(max_size.height);
-				auto min_size = weston_desktop_surface_get_min_size(dsurf);
-				dsurfb.add_min_width(min_size.width);
-				dsurfb.add_min_height(min_size.height);
-				dsurfo = dsurfb.Finish();
-			}
+#define NSEC_PER_SEC 1000000000
 
-			const char *rolename = surface->role_name != nullptr ? surface->role_name : "";
-			auto rolenameo = builder.CreateString(rolename);
-			std::string label;
-			if (surface->get_label != nullptr) {
-				label.resize(1024);
-				label.resize(surface->get_label(surface, const_cast<char *>(label.c_str()), 1024));
-			}
-			auto labelo = builder.CreateString(label);
-			SurfaceBuilder surfb(builder);
-			surfb.add_uid(reinterpret_cast<uint64_t>(surface) % 1000000);
-			Role role = Role_Other;
-			surfb.add_other_role(rolenameo);
-			if (std::string(rolename) == "xdg_toplevel") {
-				role = Role_XdgToplevel;
-			} else if (std::string(rolename) == "layer-shell") {
-				role = Role_Lsh;
+static extra_dip_trace_ring trace("compositor-management");
+// Dumping and changing the trace level of every plugin, -1 without the capabilities plugin
+// Dumping and changing the trace level of every plugin
+static int32_t cap_trace = -1;
+
+static inline int64_t timespec_sub_to_nsec(const struct timespec *a, const struct timespec *b) {
+	return (static_cast<int64_t>(a->tv_sec) - b->tv_sec) * NSEC_PER_SEC + (a->tv_nsec - b->tv_nsec);
+}
+
+static uint64_t monotonic_sec() {
+	struct timespec now {};
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+	return now.tv_sec;
+}
+
+cm_output_stats::cm_output_stats(struct cm_context *c, struct weston_output *o)
+    : ctx(c), output(o) {
+	frame_listener.notify = on_output_frame;
+	wl_signal_add(&output->frame_signal, &frame_listener);
+}
+
+cm_output_stats::~cm_output_stats() { wl_list_remove(&frame_listener.link); }
+
+void cm_output_stats::record_repaint() {
+	struct timespec now {};
+	weston_compositor_read_presentation_clock(output->compositor, &now);
+	int64_t repaint_nsec = timespec_sub_to_nsec(&now, &output->next_repaint);
+	if (repaint_nsec < 0) {
+		repaint_nsec = 0;
+	}
+	repaints++;
+	repaint_us.push(static_cast<uint32_t>(repaint_nsec / 1000));
+
+	int64_t refresh_nsec = NSEC_PER_SEC / 60;
+	if (output->current_mode != nullptr && output->current_mode->refresh > 0) {
+		refresh_nsec = 1000000000000LL / output->current_mode->refresh;
+	}
+	int64_t late_nsec = repaint_nsec - output->compositor->repaint_msec * 1000000LL;
+	if (late_nsec > 0) {
+		missed_vblanks += (late_nsec + refresh_nsec - 1) / refresh_nsec;
+	}
+
+	if (last_presentation.tv_sec != 0 || last_presentation.tv_nsec != 0) {
+		int64_t interval_nsec = timespec_sub_to_nsec(&output->frame_time, &last_presentation);
+		if (interval_nsec > 0 && interval_nsec < cm_idle_interval_nsec) {
+			present_interval_us.push(static_cast<uint32_t>(interval_nsec / 1000));
+		}
+	}
+	last_presentation = output->frame_time;
+}
+
+cm_client_stats::cm_client_stats(struct cm_context *c, struct wl_client *cl) : ctx(c), client(cl) {
+	wl_client_get_credentials(client, &pid, &uid, nullptr);
+	destroy_listener.notify = on_client_destroyed;
+	wl_client_add_destroy_listener(client, &destroy_listener);
+	resource_created_listener.notify = on_resource_created;
+	wl_client_add_resource_created_listener(client, &resource_created_listener);
+}
+
+cm_client_stats::~cm_client_stats() {
+	wl_list_remove(&destroy_listener.link);
+	wl_list_remove(&resource_created_listener.link);
+}
+
+cm_surface_meta::cm_surface_meta(struct cm_context *c, struct weston_surface *s)
+    : ctx(c), surface(s) {
+	if (surface->resource != nullptr) {
+		client = wl_resource_get_client(surface->resource);
+	}
+	destroy_listener.notify = on_surface_destroyed;
+	wl_signal_add(&surface->destroy_signal, &destroy_listener);
+	mapped = weston_surface_is_mapped(surface);
+	refresh();
+}
+
+cm_surface_meta::~cm_surface_meta() { wl_list_remove(&destroy_listener.link); }
+
+static bool update_cached(std::string &cached, const char *value, size_t len) {
+	if (cached.size() == len && cached.compare(0, len, value, len) == 0) {
+		return false;
+	}
+	cached.assign(value, len);
+	return true;
+}
+
+static bool update_cached_str(std::string &cached, const char *value) {
+	value = value != nullptr ? value : "";
+	return update_cached(cached, value, strlen(value));
+}
+
+bool cm_surface_meta::refresh() {
+	using namespace wldip::compositor_management;
+
+	bool changed = role_name != surface->role_name;
+	role_name = surface->role_name;
+	role = Role_Other;
+	if (role_name != nullptr && strcmp(role_name, "xdg_toplevel") == 0) {
+		role = Role_XdgToplevel;
+	} else if (role_name != nullptr && strcmp(role_name, "layer-shell") == 0) {
+		role = Role_Lsh;
+	}
+
+	bool was_desktop = is_desktop;
+	is_desktop = weston_surface_is_desktop_surface(surface);
+	changed |= was_desktop != is_desktop;
+	if (is_desktop) {
+		auto dsurf = weston_surface_get_desktop_surface(surface);
+		changed |= update_cached_str(title, weston_desktop_surface_get_title(dsurf));
+		changed |= update_cached_str(app_id, weston_desktop_surface_get_app_id(dsurf));
+	}
+
+	std::array<char, 512> buf;
+	size_t len = 0;
+	if (surface->get_label != nullptr) {
+		int ret = surface->get_label(surface, buf.data(), buf.size());
+		len = std::min(static_cast<size_t>(std::max(ret, 0)), buf.size() - 1);
+	}
+	changed |= update_cached(label, buf.data(), len);
+	return changed;
+}
+
+static std::string device_settings_path() {
+	const char *config_home = getenv("XDG_CONFIG_HOME");
+	if (config_home != nullptr && config_home[0] != '\0') {
+		return std::string(config_home) + "/compositor-management-devices";
+	}
+	const char *home = getenv("HOME");
+	if (home != nullptr) {
+		return std::string(home) + "/.config/compositor-management-devices";
+	}
+	return std::string();
+}
+
+cm_context::cm_context(struct weston_compositor *c) : compositor(c) {
+	desk_shell = weston_desktop_shell_get_api(c);
+	create_surface_listener.notify = on_create_surface;
+	wl_signal_add(&c->create_surface_signal, &create_surface_listener);
+	activate_listener.notify = on_activate;
+	wl_signal_add(&c->activate_signal, &activate_listener);
+	output_created_listener.notify = on_output_created;
+	wl_signal_add(&c->output_created_signal, &output_created_listener);
+	output_destroyed_listener.notify = on_output_destroyed;
+	wl_signal_add(&c->output_destroyed_signal, &output_destroyed_listener);
+	output_moved_listener.notify = on_output_moved;
+	wl_signal_add(&c->output_moved_signal, &output_moved_listener);
+	output_resized_listener.notify = on_output_resized;
+	wl_signal_add(&c->output_resized_signal, &output_resized_listener);
+	output_heads_changed_listener.notify = on_output_heads_changed;
+	wl_signal_add(&c->output_heads_changed_signal, &output_heads_changed_listener);
+	input_devices_changed_listener.notify = on_input_devices_changed;
+	wl_signal_add(&c->input_devices_changed_signal, &input_devices_changed_listener);
+	stats_timer = wl_event_loop_add_timer(wl_display_get_event_loop(c->wl_display), on_stats_timer,
+	                                      this);
+	ping_timer =
+	    wl_event_loop_add_timer(wl_display_get_event_loop(c->wl_display), on_ping_timer, this);
+	struct weston_output *output;
+	wl_list_for_each(output, &c->output_list, link) { track_output(output); }
+	client_created_listener.notify = on_client_created;
+	wl_display_add_client_created_listener(c->wl_display, &client_created_listener);
+	struct wl_client *client;
+	wl_client_for_each(client, wl_display_get_client_list(c->wl_display)) { track_client(client); }
+	wl_display_add_protocol_logger(c->wl_display, on_protocol_message, this);
+	worker.event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	worker_source = wl_event_loop_add_fd(wl_display_get_event_loop(c->wl_display), worker.event_fd,
+	                                     WL_EVENT_READABLE, on_worker_done, this);
+	// signals are read from signalfds on the compositor thread, the worker must never take them,
+	// so it's started with every signal blocked regardless of when the handlers are added
+	sigset_t all_signals, old_signals;
+	sigfillset(&all_signals);
+	pthread_sigmask(SIG_SETMASK, &all_signals, &old_signals);
+	worker.thread = std::thread([this] { worker.run(); });
+	pthread_sigmask(SIG_SETMASK, &old_signals, nullptr);
+	compositor_destroy_listener.notify = on_compositor_destroy;
+	wl_signal_add(&c->destroy_signal, &compositor_destroy_listener);
+	std::string settings_path = device_settings_path();
+	if (!settings_path.empty()) {
+		device_settings.open(settings_path.c_str());
+	}
+	apply_device_settings();
+}
+
+void cm_context::track_client(struct wl_client *client) {
+	clients.emplace(client, std::unique_ptr<cm_client_stats>(new cm_client_stats(this, client)));
+}
+
+cm_client_stats *cm_context::client_stats_for(struct weston_surface *surface) {
+	if (surface->resource == nullptr) {
+		return nullptr;
+	}
+	auto it = clients.find(wl_resource_get_client(surface->resource));
+	return it != clients.end() ? it->second.get() : nullptr;
+}
+
+cm_surface_meta *cm_context::meta_for(struct weston_surface *surface) {
+	auto it = surface_meta.find(surface);
+	if (it == surface_meta.end()) {
+		it = surface_meta
+		         .emplace(surface,
+		                  std::unique_ptr<cm_surface_meta>(new cm_surface_meta(this, surface)))
+		         .first;
+	}
+	auto *meta = it->second.get();
+	if (meta->role_name != surface->role_name ||
+	    meta->is_desktop != weston_surface_is_desktop_surface(surface)) {
+		meta->refresh();
+	}
+	return meta;
+}
+
+void cm_context::invalidate_meta(struct wl_client *client) {
+	bool any = false;
+	for (auto &kv : surface_meta) {
+		if (kv.second->client == client) {
+			kv.second->stale = true;
+			any = true;
+		}
+	}
+	if (any) {
+		surfaces_recheck = true;
+		schedule_surfaces_update(false);
+	}
+}
+
+void cm_context::schedule_surfaces_update(bool changed) {
+	surfaces_changed |= changed;
+	if (surfaces_idle == nullptr) {
+		surfaces_idle = wl_event_loop_add_idle(wl_display_get_event_loop(compositor->wl_display),
+		                                       on_surfaces_idle, this);
+	}
+}
+
+void cm_context::mark_committed(struct weston_surface *surface) {
+	auto it = surface_meta.find(surface);
+	if (it == surface_meta.end() || it->second->committed) {
+		return;
+	}
+	it->second->committed = true;
+	committed_surfaces.push_back(surface);
+}
+
+void cm_context::track_output(struct weston_output *output) {
+	if (output_stats.count(output) == 0) {
+		output_stats.emplace(output,
+		                     std::unique_ptr<cm_output_stats>(new cm_output_stats(this, output)));
+	}
+}
+
+void cm_context::untrack_output(struct weston_output *output) { output_stats.erase(output); }
+
+void cm_context::schedule_stats_update() {
+	if (outputstats_subscribers.empty() || stats_timer_armed) {
+		return;
+	}
+	wl_event_source_timer_update(stats_timer, cm_stats_interval_msec);
+	stats_timer_armed = true;
+}
+
+void cm_context::schedule_ping() {
+	if (surfaces_subscribers.empty() || ping_timer_armed) {
+		return;
+	}
+	wl_event_source_timer_update(ping_timer, cm_ping_interval_msec);
+	ping_timer_armed = true;
+}
+
+void cm_context::ping_clients() {
+	struct timespec now {};
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	bool changed = false;
+	for (auto &kv : clients) {
+		auto &cstats = *kv.second;
+		if (cstats.ping_pending && !cstats.unresponsive &&
+		    timespec_sub_to_nsec(&now, &cstats.ping_sent) > cm_unresponsive_nsec) {
+			cstats.unresponsive = true;
+			changed = true;
+		}
+	}
+	// libweston-desktop only has one ping in flight per client, pinging through every surface
+	// of a client that's already been pinged does nothing
+	for (auto &kv : surface_meta) {
+		if (kv.second->is_desktop) {
+			auto *dsurf = weston_surface_get_desktop_surface(kv.second->surface);
+			weston_desktop_client_ping(weston_desktop_surface_get_client(dsurf));
+		}
+	}
+	if (changed) {
+		schedule_surfaces_update(true);
+	}
+}
+
+void cm_context::record_ping(struct wl_client *client) {
+	auto it = clients.find(client);
+	if (it == clients.end() || it->second->ping_pending) {
+		return;
+	}
+	it->second->ping_pending = true;
+	clock_gettime(CLOCK_MONOTONIC, &it->second->ping_sent);
+}
+
+void cm_context::record_pong(struct wl_client *client) {
+	auto it = clients.find(client);
+	if (it == clients.end() || !it->second->ping_pending) {
+		return;
+	}
+	auto &cstats = *it->second;
+	struct timespec now {};
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	cstats.last_ping_us = static_cast<uint32_t>(timespec_sub_to_nsec(&now, &cstats.ping_sent) / 1000);
+	cstats.ping_us.push(cstats.last_ping_us);
+	cstats.ping_pending = false;
+	if (cstats.unresponsive) {
+		cstats.unresponsive = false;
+		schedule_surfaces_update(true);
+	}
+}
+
+void cm_snapshot::clear() {
+	kb_repeat_rate = 0;
+	kb_repeat_delay = 0;
+	strings.clear();
+	heads.clear();
+	outputs.clear();
+	seats.clear();
+	input_devices.clear();
+	surfaces.clear();
+	clients.clear();
+	role_names.clear();
+}
+
+cm_snap_str cm_snapshot::add_string(const char *str, size_t len) {
+	cm_snap_str result{static_cast<uint32_t>(strings.size()), static_cast<uint32_t>(len)};
+	strings.insert(strings.end(), str, str + len);
+	return result;
+}
+
+cm_snap_str cm_snapshot::add_string(const char *str) {
+	return str != nullptr ? add_string(str, strlen(str)) : cm_snap_str{};
+}
+
+cm_snap_str cm_snapshot::add_role_name(const char *role_name) {
+	for (const auto &rn : role_names) {
+		if (rn.first == role_name) {
+			return rn.second;
+		}
+	}
+	role_names.emplace_back(role_name, add_string(role_name));
+	return role_names.back().second;
+}
+
+void cm_context::capture_head(cm_snapshot &snap, struct weston_head *head) {
+	cm_snap_head rec{};
+	rec.name = snap.add_string(head->name);
+	rec.make = snap.add_string(head->make);
+	rec.model = snap.add_string(head->model);
+	rec.serial_number = snap.add_string(head->serial_number);
+	rec.output_id = head->output != nullptr ? head->output->id : -1;
+	rec.mm_width = head->mm_width;
+	rec.mm_height = head->mm_height;
+	rec.subpixel = head->subpixel;
+	rec.connection_internal = head->connection_internal;
+	rec.connected = head->connected;
+	rec.non_desktop = head->non_desktop;
+	snap.heads.push_back(rec);
+}
+
+void cm_context::capture_output(cm_snapshot &snap, struct weston_output *output) {
+	cm_snap_output rec{};
+	rec.id = output->id;
+	rec.name = snap.add_string(output->name);
+	rec.x = output->x;
+	rec.y = output->y;
+	rec.width = output->width;
+	rec.height = output->height;
+	rec.current_scale = output->current_scale;
+	rec.original_scale = output->original_scale;
+	auto stats_it = output_stats.find(output);
+	if (stats_it != output_stats.end()) {
+		const auto &stats = *stats_it->second;
+		rec.has_stats = true;
+		rec.repaints = stats.repaints;
+		rec.missed_vblanks = stats.missed_vblanks;
+		rec.repaint_us_p50 = stats.repaint_us.percentile(50);
+		rec.repaint_us_p99 = stats.repaint_us.percentile(99);
+		rec.repaint_us_max = stats.repaint_us.max();
+		rec.present_interval_us_p50 = stats.present_interval_us.percentile(50);
+		rec.present_interval_us_p99 = stats.present_interval_us.percentile(99);
+		rec.present_interval_us_max = stats.present_interval_us.max();
+		rec.window_size = stats.repaint_us.count;
+	}
+	snap.outputs.push_back(rec);
+}
+
+void cm_context::capture_input_device(cm_snapshot &snap, struct evdev_device *device) {
+	using namespace wldip::compositor_management;
+
+	struct libinput_device *dev = device->device;
+	cm_snap_input_device rec{};
+	rec.product_id = libinput_device_get_id_product(dev);
+	rec.vendor_id = libinput_device_get_id_vendor(dev);
+	libinput_device_get_size(dev, &rec.mm_width, &rec.mm_height);
+	rec.touch_count = libinput_device_touch_get_touch_count(dev);
+	rec.tap_finger_count = libinput_device_config_tap_get_finger_count(dev);
+	rec.tap_click_default = libinput_device_config_tap_get_default_enabled(dev) != 0u;
+	rec.tap_click = libinput_device_config_tap_get_enabled(dev) != 0u;
+	if (rec.tap_finger_count != 0) {
+		rec.tap_button_map = libinput_device_config_tap_get_button_map(dev);
+		rec.tap_button_map_default = libinput_device_config_tap_get_default_button_map(dev);
+	}
+	rec.tap_drag_default = libinput_device_config_tap_get_default_drag_enabled(dev) != 0u;
+	rec.tap_drag = libinput_device_config_tap_get_drag_enabled(dev) != 0u;
+	rec.drag_lock_default = libinput_device_config_tap_get_default_drag_lock_enabled(dev) != 0u;
+	rec.drag_lock = libinput_device_config_tap_get_drag_lock_enabled(dev) != 0u;
+	rec.send_events_mode_default = libinput_device_config_send_events_get_default_mode(dev);
+	rec.send_events_mode = libinput_device_config_send_events_get_mode(dev);
+	rec.accel_speed_default = libinput_device_config_accel_get_default_speed(dev);
+	rec.accel_speed = libinput_device_config_accel_get_speed(dev);
+	rec.accel_profile_default = libinput_device_config_accel_get_default_profile(dev);
+	rec.accel_profile = libinput_device_config_accel_get_profile(dev);
+	rec.natural_scrolling_available = libinput_device_config_scroll_has_natural_scroll(dev) != 0;
+	rec.natural_scrolling_default =
+	    libinput_device_config_scroll_get_default_natural_scroll_enabled(dev) != 0;
+	rec.natural_scrolling = libinput_device_config_scroll_get_natural_scroll_enabled(dev) != 0;
+	rec.left_handed_available = libinput_device_config_left_handed_is_available(dev) != 0;
+	rec.left_handed_default = libinput_device_config_left_handed_get_default(dev) != 0;
+	rec.left_handed = libinput_device_config_left_handed_get(dev) != 0;
+	uint32_t cmethods = libinput_device_config_click_get_methods(dev);
+	if ((cmethods & LIBINPUT_CONFIG_CLICK_METHOD_NONE) != 0u) {
+		rec.click_methods[rec.n_click_methods++] = ClickMethod_None;
+	}
+	if ((cmethods & LIBINPUT_CONFIG_CLICK_METHOD_BUTTON_AREAS) != 0u) {
+		rec.click_methods[rec.n_click_methods++] = ClickMethod_ButtonAreas;
+	}
+	if ((cmethods & LIBINPUT_CONFIG_CLICK_METHOD_CLICKFINGER) != 0u) {
+		rec.click_methods[rec.n_click_methods++] = ClickMethod_ClickFinger;
+	}
+	rec.click_method_default = libinput_device_config_click_get_default_method(dev);
+	rec.click_method = libinput_device_config_click_get_method(dev);
+	rec.middle_emulation_available = libinput_device_config_middle_emulation_is_available(dev) != 0;
+	rec.middle_emulation_default =
+	    libinput_device_config_middle_emulation_get_default_enabled(dev) != 0u;
+	rec.middle_emulation = libinput_device_config_middle_emulation_get_enabled(dev) != 0u;
+	uint32_t smethods = libinput_device_config_scroll_get_methods(dev);
+	if ((smethods & LIBINPUT_CONFIG_SCROLL_NO_SCROLL) != 0u) {
+		rec.scroll_methods[rec.n_scroll_methods++] = ScrollMethod_None;
+	}
+	if ((smethods & LIBINPUT_CONFIG_SCROLL_2FG) != 0u) {
+		rec.scroll_methods[rec.n_scroll_methods++] = ScrollMethod_TwoFingers;
+	}
+	if ((smethods & LIBINPUT_CONFIG_SCROLL_EDGE) != 0u) {
+		rec.scroll_methods[rec.n_scroll_methods++] = ScrollMethod_Edge;
+	}
+	if ((smethods & LIBINPUT_CONFIG_SCROLL_ON_BUTTON_DOWN) != 0u) {
+		rec.scroll_methods[rec.n_scroll_methods++] = ScrollMethod_OnButtonDown;
+	}
+	rec.scroll_method_default = libinput_device_config_scroll_get_default_method(dev);
+	rec.scroll_method = libinput_device_config_scroll_get_method(dev);
+	rec.scroll_button_default = libinput_device_config_scroll_get_default_button(dev);
+	rec.scroll_button = libinput_device_config_scroll_get_button(dev);
+	rec.dwt_available = libinput_device_config_dwt_is_available(dev) != 0;
+	rec.dwt_default = libinput_device_config_dwt_get_default_enabled(dev) != 0u;
+	rec.dwt = libinput_device_config_dwt_get_enabled(dev) != 0u;
+	rec.rotation_available = libinput_device_config_rotation_is_available(dev) != 0;
+	rec.rotation_default = libinput_device_config_rotation_get_default_angle(dev);
+	rec.rotation = libinput_device_config_rotation_get_angle(dev);
+	const std::array<std::pair<enum libinput_device_capability, DeviceCapability>, 7> caps = {{
+	    {LIBINPUT_DEVICE_CAP_KEYBOARD, DeviceCapability_Keyboard},
+	    {LIBINPUT_DEVICE_CAP_POINTER, DeviceCapability_Pointer},
+	    {LIBINPUT_DEVICE_CAP_TOUCH, DeviceCapability_Touch},
+	    {LIBINPUT_DEVICE_CAP_TABLET_TOOL, DeviceCapability_TabletTool},
+	    {LIBINPUT_DEVICE_CAP_TABLET_PAD, DeviceCapability_TabletPad},
+	    {LIBINPUT_DEVICE_CAP_GESTURE, DeviceCapability_Gesture},
+	    {LIBINPUT_DEVICE_CAP_SWITCH, DeviceCapability_Switch},
+	}};
+	for (const auto &cap : caps) {
+		if (libinput_device_has_capability(dev, cap.first) != 0) {
+			rec.capabilities[rec.n_capabilities++] = cap.second;
+		}
+	}
+	// libinput promises to never return NULL
+	rec.name = snap.add_string(libinput_device_get_name(dev));
+	rec.system_name = snap.add_string(libinput_device_get_sysname(dev));
+	snap.input_devices.push_back(rec);
+}
+
+void cm_context::collect_surfaces() {
+	for (auto &kv : clients) {
+		kv.second->views = 0;
+	}
+	surface_ptrs.clear();
+	struct weston_view *view;
+	wl_list_for_each(view, &compositor->view_list, link) {
+		surface_ptrs.push_back(view->surface);
+		auto *cstats = client_stats_for(view->surface);
+		if (cstats != nullptr) {
+			cstats->views++;
+		}
+	}
+	std::sort(surface_ptrs.begin(), surface_ptrs.end());
+	surface_ptrs.erase(std::unique(surface_ptrs.begin(), surface_ptrs.end()), surface_ptrs.end());
+}
+
+void cm_context::capture_surface(cm_snapshot &snap, struct weston_surface *surface) {
+	auto *meta = meta_for(surface);
+	cm_snap_surface rec{};
+	rec.uid = reinterpret_cast<uint64_t>(surface) % 1000000;
+	rec.role = meta->role;
+	rec.role_name = snap.add_role_name(meta->role_name);
+	rec.label = snap.add_string(meta->label.data(), meta->label.size());
+	if (surface->output != nullptr) {
+		rec.has_output = true;
+		rec.primary_output_id = surface->output->id;
+	}
+	auto *cstats = client_stats_for(surface);
+	if (cstats != nullptr) {
+		rec.has_client = true;
+		rec.client_pid = cstats->pid;
+		rec.ping_last_us = cstats->last_ping_us;
+		rec.ping_max_us = cstats->ping_us.max();
+		rec.ping_p95_us = cstats->ping_us.percentile(95);
+		rec.unresponsive = cstats->unresponsive;
+	}
+	rec.is_desktop = meta->is_desktop;
+	if (meta->is_desktop) {
+		auto dsurf = weston_surface_get_desktop_surface(surface);
+		rec.title = snap.add_string(meta->title.data(), meta->title.size());
+		rec.app_id = snap.add_string(meta->app_id.data(), meta->app_id.size());
+		rec.pid = weston_desktop_surface_get_pid(dsurf);
+		rec.activated = weston_desktop_surface_get_activated(dsurf);
+		rec.maximized = weston_desktop_surface_get_maximized(dsurf);
+		rec.fullscreen = weston_desktop_surface_get_fullscreen(dsurf);
+		rec.resizing = weston_desktop_surface_get_resizing(dsurf);
+		auto max_size = weston_desktop_surface_get_max_size(dsurf);
+		rec.max_width = max_size.width;
+		rec.max_height = max_size.height;
+		auto min_size = weston_desktop_surface_get_min_size(dsurf);
+		rec.min_width = min_size.width;
+		rec.min_height = min_size.height;
+	}
+	snap.surfaces.push_back(rec);
+}
+
+void cm_context::capture_state(cm_snapshot &snap) {
+	snap.clear();
+	snap.kb_repeat_rate = compositor->kb_repeat_rate;
+	snap.kb_repeat_delay = compositor->kb_repeat_delay;
+
+	struct weston_head *head;
+	wl_list_for_each(head, &compositor->head_list, compositor_link) { capture_head(snap, head); }
+
+	struct weston_output *output;
+	wl_list_for_each(output, &compositor->output_list, link) { capture_output(snap, output); }
+
+	struct weston_seat *seat;
+	wl_list_for_each(seat, &compositor->seat_list, link) {
+		cm_snap_seat rec{};
+		rec.name = snap.add_string(seat->seat_name);
+		rec.first_device = snap.input_devices.size();
+		// TODO: support fbdev/scfb
+		if (weston_drm_virtual_output_get_api(compositor) != nullptr) {
+			auto *useat = reinterpret_cast<udev_seat *>(seat);
+			struct evdev_device *device;
+			wl_list_for_each(device, &useat->devices_list, link) { capture_input_device(snap, device); }
+		}
+		rec.n_devices = snap.input_devices.size() - rec.first_device;
+		snap.seats.push_back(rec);
+	}
+
+	collect_surfaces();
+	for (const auto surface : surface_ptrs) {
+		capture_surface(snap, surface);
+	}
+
+	uint64_t now_sec = monotonic_sec();
+	for (auto &kv : clients) {
+		auto &cstats = *kv.second;
+		snap.clients.push_back(cm_snap_client{static_cast<uint64_t>(cstats.pid), cstats.uid,
+		                                      cstats.surfaces, cstats.views, cstats.resources,
+		                                      cstats.shm_bytes, cstats.requests_per_sec(now_sec)});
+	}
+}
+
+void cm_serializer::serialize(const cm_snapshot &snap) {
+	using namespace wldip::compositor_management;
+
+	builder.Clear();
+	heads.clear();
+	outputs.clear();
+	seats.clear();
+	surfaces.clear();
+	clients.clear();
+	role_names.clear();
+	auto str = [&](cm_snap_str s) {
+		return builder.CreateString(s.len > 0 ? &snap.strings[s.off] : "", s.len);
+	};
+
+	for (const auto &h : snap.heads) {
+		heads.push_back(CreateHead(builder, str(h.name), h.output_id, h.mm_width, h.mm_height,
+		                           str(h.make), str(h.model), str(h.serial_number), h.subpixel,
+		                           h.connection_internal, h.connected, h.non_desktop));
+	}
+
+	for (const auto &o : snap.outputs) {
+		flatbuffers::Offset<OutputStats> fstats = 0;
+		if (o.has_stats) {
+			fstats = CreateOutputStats(builder, o.repaints, o.missed_vblanks, o.repaint_us_p50,
+			                           o.repaint_us_p99, o.repaint_us_max, o.present_interval_us_p50,
+			                           o.present_interval_us_p99, o.present_interval_us_max,
+			                           o.window_size);
+		}
+		outputs.push_back(CreateOutput(builder, o.id, str(o.name), o.x, o.y, o.width, o.height,
+		                               o.current_scale, o.original_scale, fstats));
+	}
+
+	for (const auto &seat : snap.seats) {
+		inputs.clear();
+		for (uint32_t i = seat.first_device; i < seat.first_device + seat.n_devices; i++) {
+			const auto &d = snap.input_devices[i];
+			inputs.push_back(CreateInputDevice(
+			    builder, d.product_id, d.vendor_id, d.mm_width, d.mm_height, d.touch_count,
+			    d.tap_finger_count, d.tap_click_default, d.tap_click,
+			    static_cast<TapButtonMap>(d.tap_button_map),
+			    static_cast<TapButtonMap>(d.tap_button_map_default), d.tap_drag_default, d.tap_drag,
+			    d.drag_lock_default, d.drag_lock,
+			    static_cast<SendEventsMode>(d.send_events_mode_default),
+			    static_cast<SendEventsMode>(d.send_events_mode), d.accel_speed_default,
+			    d.accel_speed, static_cast<AccelerationProfile>(d.accel_profile_default),
+			    static_cast<AccelerationProfile>(d.accel_profile), d.natural_scrolling_available,
+			    d.natural_scrolling_default, d.natural_scrolling, d.left_handed_available,
+			    d.left_handed_default, d.left_handed,
+			    builder.CreateVector(d.click_methods.data(), d.n_click_methods),
+			    static_cast<ClickMethod>(d.click_method_default),
+			    static_cast<ClickMethod>(d.click_method), d.middle_emulation_available,
+			    d.middle_emulation_default, d.middle_emulation,
+			    builder.CreateVector(d.scroll_methods.data(), d.n_scroll_methods),
+			    static_cast<ScrollMethod>(d.scroll_method_default),
+			    static_cast<ScrollMethod>(d.scroll_method), d.scroll_button_default,
+			    d.scroll_button, d.dwt_available, d.dwt_default, d.dwt, d.rotation_available,
+			    d.rotation_default, d.rotation,
+			    builder.CreateVector(d.capabilities.data(), d.n_capabilities), str(d.name),
+			    str(d.system_name)));
+		}
+		seats.push_back(CreateSeat(builder, str(seat.name), builder.CreateVector(inputs)));
+	}
+
+	for (const auto &s : snap.surfaces) {
+		flatbuffers::Offset<DesktopSurface> dsurfo = 0;
+		if (s.is_desktop) {
+			auto titlestro = str(s.title);
+			auto appidstro = str(s.app_id);
+			DesktopSurfaceBuilder dsurfb(builder);
+			dsurfb.add_title(titlestro);
+			dsurfb.add_app_id(appidstro);
+			dsurfb.add_pid(s.pid);
+			dsurfb.add_activated(s.activated);
+			dsurfb.add_maximized(s.maximized);
+			dsurfb.add_fullscreen(s.fullscreen);
+			dsurfb.add_resizing(s.resizing);
+			dsurfb.add_max_width(s.max_width);
+			dsurfb.add_max_height(s.max_height);
+			dsurfb.add_min_width(s.min_width);
+			dsurfb.add_min_height(s.min_height);
+			dsurfb.add_ping_last_us(s.ping_last_us);
+			dsurfb.add_ping_max_us(s.ping_max_us);
+			dsurfb.add_ping_p95_us(s.ping_p95_us);
+			dsurfb.add_unresponsive(s.unresponsive);
+			dsurfo = dsurfb.Finish();
+		}
+
+		// the snapshot already shares role name strings, so each one is only written once
+		uint64_t role_key = static_cast<uint64_t>(s.role_name.off) << 32 | s.role_name.len;
+		auto role_it = std::find_if(role_names.begin(), role_names.end(),
+		                            [role_key](const auto &rn) { return rn.first == role_key; });
+		if (role_it == role_names.end()) {
+			role_names.emplace_back(role_key, str(s.role_name));
+			role_it = role_names.end() - 1;
+		}
+		auto rolenameo = role_it->second;
+		auto labelo = str(s.label);
+		SurfaceBuilder surfb(builder);
+		surfb.add_uid(s.uid);
+		surfb.add_other_role(rolenameo);
+		surfb.add_role(s.role);
+		surfb.add_label(labelo);
+		if (s.has_output) {
+			surfb.add_primary_output_id(s.primary_output_id);
+		}
+		if (s.is_desktop) {
+			surfb.add_desktop(dsurfo);
+		}
+		if (s.has_client) {
+			surfb.add_client_pid(s.client_pid);
+		}
+		surfaces.push_back(surfb.Finish());
+	}
+
+	for (const auto &c : snap.clients) {
+		clients.push_back(CreateClient(builder, c.pid, c.uid, c.surfaces, c.views, c.resources,
+		                               c.shm_bytes, c.requests_per_sec));
+	}
+
+	builder.Finish(CreateCompositorState(builder, snap.kb_repeat_rate, snap.kb_repeat_delay,
+	                                     builder.CreateVector(heads), builder.CreateVector(outputs),
+	                                     builder.CreateVector(seats), builder.CreateVector(surfaces),
+	                                     builder.CreateVector(clients)));
+}
+
+int cm_serializer::write() const {
+	int fd = shm_open(SHM_ANON, O_RDWR | O_CREAT, 0644);
+	ftruncate(fd, builder.GetSize());
+	::write(fd, builder.GetBufferPointer(), builder.GetSize());
+	lseek(fd, 0, SEEK_SET);
+	return fd;
+}
+
+void cm_worker::run() {
+	std::vector<cm_job> batch;
+	for (;;) {
+		{
+			std::unique_lock<std::mutex> guard(lock);
+			wakeup.wait(guard, [this] { return stopping || !queued.empty(); });
+			if (stopping) {
+				return;
 			}
-			surfb.add_role(role);
-			surfb.add_label(labelo);
-			if (surface->output != nullptr) {
-				surfb.add_primary_output_id(surface->output->id);
+			std::swap(batch, queued);
+		}
+		for (auto &job : batch) {
+			serializer.serialize(*job.snap);
+			job.fd = serializer.write();
+		}
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			done.insert(done.end(), batch.begin(), batch.end());
+		}
+		batch.clear();
+		uint64_t one = 1;
+		::write(event_fd, &one, sizeof(one));
+	}
+}
+
+int cm_context::make_update() {
+	capture_state(local_snapshot);
+	local_serializer.serialize(local_snapshot);
+	return local_serializer.write();
+}
+
+void cm_context::queue_update(uint32_t topic, uint32_t token) {
+	cm_snapshot *snap;
+	if (spare_snapshots.empty()) {
+		snap = new cm_snapshot;
+	} else {
+		snap = spare_snapshots.back().release();
+		spare_snapshots.pop_back();
+	}
+	struct timespec now {};
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	capture_state(*snap);
+	{
+		std::lock_guard<std::mutex> guard(worker.lock);
+		worker.queued.push_back(cm_job{snap, topic, token, -1, now});
+	}
+	worker.wakeup.notify_one();
+}
+
+void cm_context::stop_worker() {
+	{
+		std::lock_guard<std::mutex> guard(worker.lock);
+		worker.stopping = true;
+	}
+	worker.wakeup.notify_one();
+	worker.thread.join();
+	wl_event_source_remove(worker_source);
+	close(worker.event_fd);
+	for (auto &job : worker.done) {
+		close(job.fd);
+	}
+}
+
+const std::unordered_set<struct wl_resource *> &cm_context::subscribers(uint32_t topic) {
+	static const std::unordered_set<struct wl_resource *> none;
+	switch (topic) {
+		case WLDIP_COMPOSITOR_MANAGER_TOPIC_SURFACES:
+			return surfaces_subscribers;
+		case WLDIP_COMPOSITOR_MANAGER_TOPIC_OUTPUTS:
+			return outputs_subscribers;
+		case WLDIP_COMPOSITOR_MANAGER_TOPIC_INPUTDEVS:
+			return inputdevs_subscribers;
+		case WLDIP_COMPOSITOR_MANAGER_TOPIC_OUTPUT_STATS:
+			return outputstats_subscribers;
+		default:
+			return none;
+	}
+}
+
+bool cm_context::can_deliver(struct wl_resource *resource) {
+	auto it = flow.find(resource);
+	if (it != flow.end() && it->second.acks && it->second.unacked > 0) {
+		it->second.pending = true;
+		return false;
+	}
+	return true;
+}
+
+void cm_context::deliver(struct wl_resource *resource, int fd) {
+	wldip_compositor_manager_send_update(resource, fd);
+	auto &sub = flow[resource];
+	sub.unacked++;
+	sub.pending = false;
+}
+
+void cm_context::send_update_to(struct wl_resource *resource) {
+	uint32_t token = ++next_token;
+	pending_gets.emplace_back(token, resource);
+	queue_update(0, token);
+}
+
+void cm_context::broadcast(uint32_t topic) {
+	bool any = false;
+	for (auto resource : subscribers(topic)) {
+		any |= can_deliver(resource);
+	}
+	if (any) {
+		queue_update(topic, 0);
+	}
+}
+
+void cm_context::dispatch_finished() {
+	{
+		std::lock_guard<std::mutex> guard(worker.lock);
+		std::swap(finished, worker.done);
+	}
+	struct timespec now {};
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	for (auto &job : finished) {
+		EXTRA_DIP_TRACE(trace, EXTRA_DIP_TRACE_DEBUG, "update capture to dispatch us", job.topic,
+		                job.token, timespec_sub_to_nsec(&now, &job.queued) / 1000);
+		if (job.topic != 0) {
+			for (auto resource : subscribers(job.topic)) {
+				if (can_deliver(resource)) {
+					deliver(resource, job.fd);
+				}
 			}
-			if (weston_surface_is_desktop_surface(surface)) {
-				surfb.add_desktop(dsurfo);
+		} else {
+			auto it = std::find_if(pending_gets.begin(), pending_gets.end(),
+			                       [&job](const auto &pg) { return pg.first == job.token; });
+			// the resource may have been destroyed while the job was in flight
+			if (it != pending_gets.end()) {
+				deliver(it->second, job.fd);
+				pending_gets.erase(it);
 			}
-			fsurfaces.push_back(surfb.Finish());
 		}
+		close(job.fd);
+		spare_snapshots.emplace_back(job.snap);
+	}
+	finished.clear();
+}
+
+void cm_context::send_update_surface() { broadcast(WLDIP_COMPOSITOR_MANAGER_TOPIC_SURFACES); }
 
-		builder.Finish(
-		    CreateCompositorState(builder, compositor->kb_repeat_rate, compositor->kb_repeat_delay,
-		                          builder.CreateVector(fheads), builder.CreateVector(foutputs),
-		                          builder.CreateVector(fseats), builder.CreateVector(fsurfaces)));
-		int fd = shm_open(SHM_ANON, O_RDWR | O_CREAT, 0644);
-		ftruncate(fd, builder.GetSize());
-		write(fd, builder.GetBufferPointer(), builder.GetSize());
-		lseek(fd, 0, SEEK_SET);
-		return fd;
+void cm_context::send_update_output() {
+	// the output signals fired while applying a layout are covered by the update at the end
+	if (applying_layout) {
+		return;
 	}
+	broadcast(WLDIP_COMPOSITOR_MANAGER_TOPIC_OUTPUTS);
+}
 
-	void send_update_to(struct wl_resource *resource) {
-		int fd = make_update();
-		wldip_compositor_manager_send_update(resource, fd);
-		close(fd);
+void cm_context::send_update_inputdevs() { broadcast(WLDIP_COMPOSITOR_MANAGER_TOPIC_INPUTDEVS); }
+
+void cm_context::send_update_outputstats() {
+	broadcast(WLDIP_COMPOSITOR_MANAGER_TOPIC_OUTPUT_STATS);
+}
+
+void cm_context::with_input_device(uint32_t seat_idx, uint32_t device_idx,
+                                   const std::function<void(evdev_device *)> &f) {
+	struct weston_seat *seat;
+	uint32_t cur_seat = 0, cur_dev = 0;
+	wl_list_for_each(seat, &compositor->seat_list, link) {
+		if (cur_seat++ != seat_idx) {
+			continue;
+		}
+		// TODO: support fbdev/scfb
+		if (weston_drm_virtual_output_get_api(compositor) != nullptr) {
+			auto *useat = reinterpret_cast<udev_seat *>(seat);
+			struct evdev_device *device;
+			wl_list_for_each(device, &useat->devices_list, link) {
+				if (cur_dev++ == device_idx) {
+					f(device);
+					break;
+				}
+			}
+		}
 	}
+}
 
-	void send_update_surface() {
-		int fd = make_update();
-		for (auto resource : surfaces_subscribers) {
-			wldip_compositor_manager_send_update(resource, fd);
+static struct weston_output *find_output(struct weston_compositor *compositor,
+                                         const std::string &name) {
+	struct weston_output *output;
+	wl_list_for_each(output, &compositor->output_list, link) {
+		if (output->name != nullptr && name == output->name) {
+			return output;
+		}
+	}
+	wl_list_for_each(output, &compositor->pending_output_list, link) {
+		if (output->name != nullptr && name == output->name) {
+			return output;
 		}
-		close(fd);
 	}
+	return nullptr;
+}
 
-	void send_update_output() {
-		int fd = make_update();
-		for (auto resource : outputs_subscribers) {
-			wldip_compositor_manager_send_update(resource, fd);
+static struct weston_mode *find_mode(struct weston_output *output, const cm_output_config &conf) {
+	if (conf.width == 0 && conf.height == 0) {
+		return output->current_mode;
+	}
+	struct weston_mode *mode;
+	wl_list_for_each(mode, &output->mode_list, link) {
+		if (mode->width == conf.width && mode->height == conf.height &&
+		    (conf.refresh == 0 || mode->refresh == conf.refresh)) {
+			return mode;
 		}
-		close(fd);
 	}
+	return nullptr;
+}
 
-	void send_update_inputdevs() {
-		int fd = make_update();
-		for (auto resource : inputdevs_subscribers) {
-			wldip_compositor_manager_send_update(resource, fd);
+std::string cm_context::check_layout(const std::vector<cm_output_config> &layout) {
+	std::unordered_set<std::string> names;
+	for (const auto &conf : layout) {
+		if (!names.insert(conf.name).second) {
+			return "output " + conf.name + " is in the layout more than once";
+		}
+		auto *output = find_output(compositor, conf.name);
+		if (output == nullptr) {
+			return "unknown output " + conf.name;
+		}
+		if (!conf.enabled) {
+			continue;
+		}
+		if (find_mode(output, conf) == nullptr) {
+			return "output " + conf.name + " has no mode " + std::to_string(conf.width) + "x" +
+			       std::to_string(conf.height) + "@" + std::to_string(conf.refresh);
+		}
+		// libweston sets the transform once, before the output is first enabled
+		if (output->transform != UINT32_MAX &&
+		    output->transform != static_cast<uint32_t>(conf.transform)) {
+			return "the transform of output " + conf.name + " can't be changed";
 		}
-		close(fd);
 	}
+	return std::string();
+}
 
-	void with_input_device(uint32_t seat_idx, uint32_t device_idx,
-	                       const std::function<void(evdev_device *)> &f) {
-		struct weston_seat *seat;
-		uint32_t cur_seat = 0, cur_dev = 0;
-		wl_list_for_each(seat, &compositor->seat_list, link) {
-			if (cur_seat++ != seat_idx) {
+void cm_context::apply_layout(const std::vector<cm_output_config> &layout) {
+	EXTRA_DIP_TRACE(trace, EXTRA_DIP_TRACE_INFO, "apply layout", layout.size());
+	applying_layout = true;
+	// disabling first releases CRTCs for the outputs that are about to be enabled
+	for (const auto &conf : layout) {
+		auto *output = find_output(compositor, conf.name);
+		if (!conf.enabled && output->enabled) {
+			weston_output_disable(output);
+		}
+	}
+	for (const auto &conf : layout) {
+		auto *output = find_output(compositor, conf.name);
+		if (!conf.enabled) {
+			continue;
+		}
+		if (!output->enabled) {
+			weston_output_set_scale(output, conf.scale);
+			if (output->transform == UINT32_MAX) {
+				weston_output_set_transform(output, conf.transform);
+			}
+			if (weston_output_enable(output) < 0) {
+				// a backend failure, nothing check_layout could have caught
+				weston_log("compositor-management: could not enable output %s\n", conf.name.c_str());
 				continue;
 			}
-			// TODO: support fbdev/scfb
-			if (weston_drm_virtual_output_get_api(compositor) != nullptr) {
-				auto *useat = reinterpret_cast<udev_seat *>(seat);
-				struct evdev_device *device;
-				wl_list_for_each(device, &useat->devices_list, link) {
-					if (cur_dev++ == device_idx) {
-						f(device);
-						break;
-					}
+		}
+		auto *mode = find_mode(output, conf);
+		if (mode != output->current_mode) {
+			weston_output_mode_set_native(output, mode, output->current_scale);
+		}
+		if (output->current_scale != static_cast<float>(conf.scale)) {
+			weston_output_set_scale(output, conf.scale);
+		}
+		if (output->x != conf.x || output->y != conf.y) {
+			weston_output_move(output, conf.x, conf.y);
+		}
+	}
+	applying_layout = false;
+	weston_compositor_damage_all(compositor);
+	send_update_output();
+}
+
+void cm_context::apply_device_settings() {
+	auto &store = device_settings;
+	store.seen.clear();
+	// TODO: support fbdev/scfb
+	if (weston_drm_virtual_output_get_api(compositor) != nullptr) {
+		struct weston_seat *seat;
+		wl_list_for_each(seat, &compositor->seat_list, link) {
+			auto *useat = reinterpret_cast<udev_seat *>(seat);
+			struct evdev_device *device;
+			wl_list_for_each(device, &useat->devices_list, link) {
+				store.seen.insert(device->device);
+				if (store.applied.count(device->device) == 0) {
+					store.apply(device->device);
 				}
 			}
 		}
 	}
+	std::swap(store.applied, store.seen);
+}
 
-	cm_context(cm_context &&) = delete;
-};
+void cm_device_settings_store::open(const char *path) {
+	int fd = ::open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		weston_log("compositor-management: could not open %s: %s\n", path, strerror(errno));
+		return;
+	}
+	struct stat st {};
+	bool fresh = fstat(fd, &st) != 0 || st.st_size != sizeof(cm_device_settings_file);
+	if (fresh && ftruncate(fd, sizeof(cm_device_settings_file)) != 0) {
+		weston_log("compositor-management: could not resize %s: %s\n", path, strerror(errno));
+		close(fd);
+		return;
+	}
+	void *map =
+	    mmap(nullptr, sizeof(cm_device_settings_file), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		weston_log("compositor-management: could not map %s: %s\n", path, strerror(errno));
+		return;
+	}
+	file = static_cast<cm_device_settings_file *>(map);
+	if (fresh || file->magic != cm_device_settings_magic ||
+	    file->version != cm_device_settings_version) {
+		memset(file, 0, sizeof(cm_device_settings_file));
+		file->magic = cm_device_settings_magic;
+		file->version = cm_device_settings_version;
+	}
+}
+
+cm_device_settings *cm_device_settings_store::find(struct libinput_device *device, bool create) {
+	if (file == nullptr) {
+		return nullptr;
+	}
+	uint32_t vendor_id = libinput_device_get_id_vendor(device);
+	uint32_t product_id = libinput_device_get_id_product(device);
+	const char *name = libinput_device_get_name(device);
+	size_t count = std::min<size_t>(file->count, cm_device_settings_max);
+	for (size_t i = 0; i < count; i++) {
+		auto &rec = file->records[i];
+		if (rec.vendor_id == vendor_id && rec.product_id == product_id &&
+		    strncmp(rec.name, name, cm_device_name_max - 1) == 0) {
+			return &rec;
+		}
+	}
+	if (!create || count == cm_device_settings_max) {
+		return nullptr;
+	}
+	auto &rec = file->records[count];
+	memset(&rec, 0, sizeof(rec));
+	rec.vendor_id = vendor_id;
+	rec.product_id = product_id;
+	strncpy(rec.name, name, cm_device_name_max - 1);
+	file->count = count + 1;
+	return &rec;
+}
+
+// The value is read back from libinput, so an option the device rejected isn't stored
+void cm_device_settings_store::store(struct libinput_device *device, cm_device_option option) {
+	auto *rec = find(device, true);
+	if (rec == nullptr) {
+		return;
+	}
+	switch (option) {
+		case CM_DEVICE_TAP_CLICK:
+			rec->tap_click = libinput_device_config_tap_get_enabled(device);
+			break;
+		case CM_DEVICE_TAP_DRAG:
+			rec->tap_drag = libinput_device_config_tap_get_drag_enabled(device);
+			break;
+		case CM_DEVICE_DRAG_LOCK:
+			rec->drag_lock = libinput_device_config_tap_get_drag_lock_enabled(device);
+			break;
+		case CM_DEVICE_SEND_EVENTS_MODE:
+			rec->send_events_mode = libinput_device_config_send_events_get_mode(device);
+			break;
+		case CM_DEVICE_ACCEL_SPEED:
+			rec->accel_speed = libinput_device_config_accel_get_speed(device);
+			break;
+		case CM_DEVICE_ACCEL_PROFILE:
+			rec->accel_profile = libinput_device_config_accel_get_profile(device);
+			break;
+		case CM_DEVICE_NATURAL_SCROLLING:
+			rec->natural_scrolling = libinput_device_config_scroll_get_natural_scroll_enabled(device);
+			break;
+		case CM_DEVICE_LEFT_HANDED:
+			rec->left_handed = libinput_device_config_left_handed_get(device);
+			break;
+		case CM_DEVICE_CLICK_METHOD:
+			rec->click_method = libinput_device_config_click_get_method(device);
+			break;
+		case CM_DEVICE_SCROLL_METHOD:
+			rec->scroll_method = libinput_device_config_scroll_get_method(device);
+			break;
+		case CM_DEVICE_MIDDLE_EMULATION:
+			rec->middle_emulation = libinput_device_config_middle_emulation_get_enabled(device);
+			break;
+		case CM_DEVICE_DWT:
+			rec->dwt = libinput_device_config_dwt_get_enabled(device);
+			break;
+	}
+	rec->set |= option;
+}
+
+void cm_device_settings_store::apply(struct libinput_device *device) {
+	const auto *rec = find(device, false);
+	if (rec == nullptr) {
+		return;
+	}
+	EXTRA_DIP_TRACE(trace, EXTRA_DIP_TRACE_INFO, "apply device settings", rec->vendor_id,
+	                rec->product_id, rec->set);
+	if ((rec->set & CM_DEVICE_TAP_CLICK) != 0u) {
+		libinput_device_config_tap_set_enabled(
+		    device, static_cast<enum libinput_config_tap_state>(rec->tap_click));
+	}
+	if ((rec->set & CM_DEVICE_TAP_DRAG) != 0u) {
+		libinput_device_config_tap_set_drag_enabled(
+		    device, static_cast<enum libinput_config_drag_state>(rec->tap_drag));
+	}
+	if ((rec->set & CM_DEVICE_DRAG_LOCK) != 0u) {
+		libinput_device_config_tap_set_drag_lock_enabled(
+		    device, static_cast<enum libinput_config_drag_lock_state>(rec->drag_lock));
+	}
+	if ((rec->set & CM_DEVICE_SEND_EVENTS_MODE) != 0u) {
+		libinput_device_config_send_events_set_mode(device, rec->send_events_mode);
+	}
+	if ((rec->set & CM_DEVICE_ACCEL_SPEED) != 0u) {
+		libinput_device_config_accel_set_speed(device, rec->accel_speed);
+	}
+	if ((rec->set & CM_DEVICE_ACCEL_PROFILE) != 0u) {
+		libinput_device_config_accel_set_profile(
+		    device, static_cast<enum libinput_config_accel_profile>(rec->accel_profile));
+	}
+	if ((rec->set & CM_DEVICE_NATURAL_SCROLLING) != 0u) {
+		libinput_device_config_scroll_set_natural_scroll_enabled(device, rec->natural_scrolling);
+	}
+	if ((rec->set & CM_DEVICE_LEFT_HANDED) != 0u) {
+		libinput_device_config_left_handed_set(device, rec->left_handed);
+	}
+	if ((rec->set & CM_DEVICE_CLICK_METHOD) != 0u) {
+		libinput_device_config_click_set_method(
+		    device, static_cast<enum libinput_config_click_method>(rec->click_method));
+	}
+	if ((rec->set & CM_DEVICE_SCROLL_METHOD) != 0u) {
+		libinput_device_config_scroll_set_method(
+		    device, static_cast<enum libinput_config_scroll_method>(rec->scroll_method));
+	}
+	if ((rec->set & CM_DEVICE_MIDDLE_EMULATION) != 0u) {
+		libinput_device_config_middle_emulation_set_enabled(
+		    device, static_cast<enum libinput_config_middle_emulation_state>(rec->middle_emulation));
+	}
+	if ((rec->set & CM_DEVICE_DWT) != 0u) {
+		libinput_device_config_dwt_set_enabled(device,
+		                                       static_cast<enum libinput_config_dwt_state>(rec->dwt));
+	}
+}
 
 static void on_create_surface(struct wl_listener *listener, void *data) {
 	auto *ctx =
 	    wl_container_of(listener, static_cast<struct cm_context *>(nullptr), create_surface_listener);
-	ctx->send_update_surface();
+	ctx->meta_for(static_cast<struct weston_surface *>(data));
+	ctx->schedule_surfaces_update(true);
 }
 
 static void on_activate(struct wl_listener *listener, void *data) {
 	auto *ctx =
 	    wl_container_of(listener, static_cast<struct cm_context *>(nullptr), activate_listener);
-	ctx->send_update_surface();
+	ctx->schedule_surfaces_update(true);
 }
 
 static void on_output_created(struct wl_listener *listener, void *data) {
 	auto *ctx =
 	    wl_container_of(listener, static_cast<struct cm_context *>(nullptr), output_created_listener);
+	ctx->track_output(static_cast<struct weston_output *>(data));
 	ctx->send_update_output();
 }
 
 static void on_output_destroyed(struct wl_listener *listener, void *data) {
 	auto *ctx = wl_container_of(listener, static_cast<struct cm_context *>(nullptr),
 	                            output_destroyed_listener);
+	ctx->untrack_output(static_cast<struct weston_output *>(data));
 	ctx->send_update_output();
 }
 
@@ -378,13 +1262,225 @@ static void on_output_heads_changed(struct wl_listener *listener, void *data) {
 static void on_input_devices_changed(struct wl_listener *listener, void *data) {
 	auto *ctx = wl_container_of(listener, static_cast<struct cm_context *>(nullptr),
 	                            input_devices_changed_listener);
+	ctx->apply_device_settings();
 	ctx->send_update_inputdevs();
 }
 
+static void on_output_frame(struct wl_listener *listener, void *data) {
+	auto *stats =
+	    wl_container_of(listener, static_cast<struct cm_output_stats *>(nullptr), frame_listener);
+	auto *ctx = stats->ctx;
+	stats->record_repaint();
+	ctx->schedule_stats_update();
+	// surfaces are mapped and unmapped by commits, which are followed by a repaint
+	if (!ctx->committed_surfaces.empty() || ctx->surfaces_recheck) {
+		ctx->schedule_surfaces_update(false);
+	}
+}
+
+static int on_stats_timer(void *data) {
+	auto *ctx = static_cast<struct cm_context *>(data);
+	ctx->stats_timer_armed = false;
+	ctx->send_update_outputstats();
+	return 0;
+}
+
+static int on_ping_timer(void *data) {
+	auto *ctx = static_cast<struct cm_context *>(data);
+	ctx->ping_timer_armed = false;
+	ctx->ping_clients();
+	ctx->schedule_ping();
+	return 0;
+}
+
+static void on_client_created(struct wl_listener *listener, void *data) {
+	auto *ctx =
+	    wl_container_of(listener, static_cast<struct cm_context *>(nullptr), client_created_listener);
+	ctx->track_client(static_cast<struct wl_client *>(data));
+}
+
+static void on_client_destroyed(struct wl_listener *listener, void *data) {
+	auto *cstats =
+	    wl_container_of(listener, static_cast<struct cm_client_stats *>(nullptr), destroy_listener);
+	// the client's resources are destroyed after this, their trackers see the client as untracked
+	cstats->ctx->clients.erase(cstats->client);
+}
+
+static void on_resource_created(struct wl_listener *listener, void *data) {
+	auto *cstats = wl_container_of(listener, static_cast<struct cm_client_stats *>(nullptr),
+	                               resource_created_listener);
+	auto *resource = static_cast<struct wl_resource *>(data);
+	auto *ctx = cstats->ctx;
+	struct cm_resource_tracker *tracker;
+	if (ctx->free_trackers.empty()) {
+		tracker = new cm_resource_tracker{ctx, resource};
+	} else {
+		tracker = ctx->free_trackers.back();
+		ctx->free_trackers.pop_back();
+		*tracker = cm_resource_tracker{ctx, resource};
+	}
+	tracker->destroy_listener.notify = on_resource_destroyed;
+	wl_resource_add_destroy_listener(resource, &tracker->destroy_listener);
+	cstats->resources++;
+	const char *cls = wl_resource_get_class(resource);
+	if (strcmp(cls, "wl_surface") == 0) {
+		tracker->is_surface = true;
+		cstats->surfaces++;
+	} else if (strcmp(cls, "wl_buffer") == 0) {
+		if (ctx->uninspected_buffers.empty()) {
+			ctx->inspect_buffers_idle = wl_event_loop_add_idle(
+			    wl_display_get_event_loop(ctx->compositor->wl_display), on_inspect_buffers, ctx);
+		}
+		ctx->uninspected_buffers.push_back(tracker);
+	}
+}
+
+static void on_resource_destroyed(struct wl_listener *listener, void *data) {
+	auto *tracker = wl_container_of(listener, static_cast<struct cm_resource_tracker *>(nullptr),
+	                                destroy_listener);
+	auto *ctx = tracker->ctx;
+	auto &pending = ctx->uninspected_buffers;
+	auto pending_it = std::find(pending.begin(), pending.end(), tracker);
+	if (pending_it != pending.end()) {
+		pending.erase(pending_it);
+		if (pending.empty()) {
+			wl_event_source_remove(ctx->inspect_buffers_idle);
+			ctx->inspect_buffers_idle = nullptr;
+		}
+	}
+	auto client_it = ctx->clients.find(wl_resource_get_client(tracker->resource));
+	if (client_it != ctx->clients.end()) {
+		auto &cstats = *client_it->second;
+		cstats.resources--;
+		cstats.shm_bytes -= tracker->shm_bytes;
+		if (tracker->is_surface) {
+			cstats.surfaces--;
+		}
+	}
+	wl_list_remove(&tracker->destroy_listener.link);
+	ctx->free_trackers.push_back(tracker);
+}
+
+static void on_inspect_buffers(void *data) {
+	auto *ctx = static_cast<struct cm_context *>(data);
+	ctx->inspect_buffers_idle = nullptr;
+	for (auto *tracker : ctx->uninspected_buffers) {
+		struct wl_shm_buffer *shm_buffer = wl_shm_buffer_get(tracker->resource);
+		auto client_it = ctx->clients.find(wl_resource_get_client(tracker->resource));
+		if (shm_buffer == nullptr || client_it == ctx->clients.end()) {
+			continue;
+		}
+		tracker->shm_bytes = static_cast<uint64_t>(wl_shm_buffer_get_stride(shm_buffer)) *
+		                     wl_shm_buffer_get_height(shm_buffer);
+		client_it->second->shm_bytes += tracker->shm_bytes;
+	}
+	ctx->uninspected_buffers.clear();
+}
+
+static void on_protocol_message(void *user_data, enum wl_protocol_logger_type direction,
+                                const struct wl_protocol_logger_message *message) {
+	auto *ctx = static_cast<struct cm_context *>(user_data);
+	struct wl_client *client = wl_resource_get_client(message->resource);
+	const char *name = message->message->name;
+	// the ping events and pong requests of xdg_wm_base, zxdg_shell_v6 and wl_shell_surface
+	if (direction != WL_PROTOCOL_LOGGER_REQUEST) {
+		if (strcmp(name, "ping") == 0) {
+			ctx->record_ping(client);
+		}
+		return;
+	}
+	if (strcmp(name, "pong") == 0) {
+		ctx->record_pong(client);
+	}
+	auto it = ctx->clients.find(client);
+	if (it != ctx->clients.end()) {
+		it->second->count_request(monotonic_sec());
+	}
+	// xdg_toplevel, zxdg_toplevel_v6 and wl_shell_surface metadata; the request hasn't been
+	// handled yet, so the cached strings are refreshed from an idle callback
+	if (strcmp(name, "set_title") == 0 || strcmp(name, "set_app_id") == 0 ||
+	    strcmp(name, "set_class") == 0) {
+		ctx->invalidate_meta(client);
+	}
+	// only tracked while someone is subscribed to surfaces, there is nobody to notify otherwise
+	if (!ctx->surfaces_subscribers.empty()) {
+		const char *cls = wl_resource_get_class(message->resource);
+		if (strcmp(name, "commit") == 0 && strcmp(cls, "wl_surface") == 0) {
+			ctx->mark_committed(
+			    static_cast<struct weston_surface *>(wl_resource_get_user_data(message->resource)));
+		} else if (strcmp(name, "destroy") == 0 && strcmp(cls, "wl_buffer") != 0 &&
+		           strcmp(cls, "wl_region") != 0) {
+			// destroying a role object unmaps the surface without a commit
+			ctx->surfaces_recheck = true;
+		}
+	}
+}
+
+static void on_surface_destroyed(struct wl_listener *listener, void *data) {
+	auto *meta =
+	    wl_container_of(listener, static_cast<struct cm_surface_meta *>(nullptr), destroy_listener);
+	auto *ctx = meta->ctx;
+	ctx->surface_meta.erase(meta->surface);
+	// the surface's views are still in the view list until the destroy is finished
+	ctx->schedule_surfaces_update(true);
+}
+
+static bool update_mapped(struct cm_surface_meta &meta) {
+	bool mapped = weston_surface_is_mapped(meta.surface);
+	bool changed = mapped != meta.mapped;
+	meta.mapped = mapped;
+	return changed;
+}
+
+static void on_surfaces_idle(void *data) {
+	auto *ctx = static_cast<struct cm_context *>(data);
+	ctx->surfaces_idle = nullptr;
+	bool changed = ctx->surfaces_changed;
+	ctx->surfaces_changed = false;
+	// destroyed surfaces are no longer in surface_meta
+	for (auto *surface : ctx->committed_surfaces) {
+		auto it = ctx->surface_meta.find(surface);
+		if (it != ctx->surface_meta.end()) {
+			it->second->committed = false;
+			changed |= update_mapped(*it->second);
+		}
+	}
+	ctx->committed_surfaces.clear();
+	if (ctx->surfaces_recheck) {
+		ctx->surfaces_recheck = false;
+		for (auto &kv : ctx->surface_meta) {
+			auto &meta = *kv.second;
+			if (meta.stale) {
+				meta.stale = false;
+				changed |= meta.refresh();
+			}
+			changed |= update_mapped(meta);
+		}
+	}
+	if (changed) {
+		ctx->send_update_surface();
+	}
+}
+
+static int on_worker_done(int fd, uint32_t mask, void *data) {
+	auto *ctx = static_cast<struct cm_context *>(data);
+	uint64_t count;
+	read(fd, &count, sizeof(count));
+	ctx->dispatch_finished();
+	return 0;
+}
+
+static void on_compositor_destroy(struct wl_listener *listener, void *data) {
+	auto *ctx = wl_container_of(listener, static_cast<struct cm_context *>(nullptr),
+	                            compositor_destroy_listener);
+	ctx->stop_worker();
+}
+
 static void cm_subscribe(struct wl_client *client, struct wl_resource *resource, uint32_t topics) {
 	auto *ctx = static_cast<struct cm_context *>(wl_resource_get_user_data(resource));
 	if ((topics & WLDIP_COMPOSITOR_MANAGER_TOPIC_SURFACES) != 0u) {
 		ctx->surfaces_subscribers.insert(resource);
+		ctx->schedule_ping();
 	}
 	if ((topics & WLDIP_COMPOSITOR_MANAGER_TOPIC_OUTPUTS) != 0u) {
 		ctx->outputs_subscribers.insert(resource);
@@ -392,6 +1488,9 @@ static void cm_subscribe(struct wl_client *client, struct wl_resource *resource,
 	if ((topics & WLDIP_COMPOSITOR_MANAGER_TOPIC_INPUTDEVS) != 0u) {
 		ctx->inputdevs_subscribers.insert(resource);
 	}
+	if ((topics & WLDIP_COMPOSITOR_MANAGER_TOPIC_OUTPUT_STATS) != 0u) {
+		ctx->outputstats_subscribers.insert(resource);
+	}
 }
 
 static void cm_get(struct wl_client *client, struct wl_resource *resource) {
@@ -399,6 +1498,98 @@ static void cm_get(struct wl_client *client, struct wl_resource *resource) {
 	ctx->send_update_to(resource);
 }
 
+static void cm_ack(struct wl_client *client, struct wl_resource *resource) {
+	auto *ctx = static_cast<struct cm_context *>(wl_resource_get_user_data(resource));
+	auto &flow = ctx->flow[resource];
+	flow.acks = true;
+	if (flow.unacked > 0) {
+		flow.unacked--;
+	}
+	if (flow.unacked == 0 && flow.pending) {
+		ctx->send_update_to(resource);
+	}
+}
+
+static void send_query_result(struct wl_resource *resource, uint32_t serial) {
+	auto *ctx = static_cast<struct cm_context *>(wl_resource_get_user_data(resource));
+	ctx->local_serializer.serialize(ctx->local_snapshot);
+	int fd = ctx->local_serializer.write();
+	wldip_compositor_manager_send_query_result(resource, serial, fd);
+	close(fd);
+}
+
+static void cm_query_surfaces(struct wl_client *client, struct wl_resource *resource,
+                              uint32_t serial, uint32_t filter, const char *text,
+                              uint32_t number) {
+	auto *ctx = static_cast<struct cm_context *>(wl_resource_get_user_data(resource));
+	auto &snap = ctx->local_snapshot;
+	snap.clear();
+	ctx->collect_surfaces();
+	for (const auto surface : ctx->surface_ptrs) {
+		auto *meta = ctx->meta_for(surface);
+		bool matches = false;
+		switch (filter) {
+			case WLDIP_COMPOSITOR_MANAGER_SURFACE_FILTER_ALL:
+				matches = true;
+				break;
+			case WLDIP_COMPOSITOR_MANAGER_SURFACE_FILTER_APP_ID:
+				matches = meta->is_desktop && text != nullptr && meta->app_id == text;
+				break;
+			case WLDIP_COMPOSITOR_MANAGER_SURFACE_FILTER_PID: {
+				auto *cstats = ctx->client_stats_for(surface);
+				matches = cstats != nullptr && static_cast<uint32_t>(cstats->pid) == number;
+				break;
+			}
+			case WLDIP_COMPOSITOR_MANAGER_SURFACE_FILTER_OUTPUT:
+				matches = surface->output != nullptr && surface->output->id == number;
+				break;
+			case WLDIP_COMPOSITOR_MANAGER_SURFACE_FILTER_ROLE:
+				matches = static_cast<uint32_t>(meta->role) == number;
+				break;
+			default:
+				break;
+		}
+		if (matches) {
+			ctx->capture_surface(snap, surface);
+		}
+	}
+	send_query_result(resource, serial);
+}
+
+static void cm_query_input_device(struct wl_client *client, struct wl_resource *resource,
+                                  uint32_t serial, uint32_t seat_idx, uint32_t device_idx) {
+	auto *ctx = static_cast<struct cm_context *>(wl_resource_get_user_data(resource));
+	auto &snap = ctx->local_snapshot;
+	snap.clear();
+	ctx->with_input_device(seat_idx, device_idx, [ctx, &snap](struct evdev_device *device) {
+		cm_snap_seat rec{};
+		rec.name = snap.add_string(device->seat->seat_name);
+		rec.first_device = snap.input_devices.size();
+		rec.n_devices = 1;
+		ctx->capture_input_device(snap, device);
+		snap.seats.push_back(rec);
+	});
+	send_query_result(resource, serial);
+}
+
+static void cm_query_head(struct wl_client *client, struct wl_resource *resource, uint32_t serial,
+                          const char *name) {
+	auto *ctx = static_cast<struct cm_context *>(wl_resource_get_user_data(resource));
+	auto &snap = ctx->local_snapshot;
+	snap.clear();
+	struct weston_head *head;
+	wl_list_for_each(head, &ctx->compositor->head_list, compositor_link) {
+		if (head->name != nullptr && strcmp(head->name, name) == 0) {
+			ctx->capture_head(snap, head);
+			if (head->output != nullptr) {
+				ctx->capture_output(snap, head->output);
+			}
+			break;
+		}
+	}
+	send_query_result(resource, serial);
+}
+
 static void cm_desktop_surface_activate(struct wl_client *client, struct wl_resource *resource,
                                         uint32_t surface_uid) {
 	auto *ctx = static_cast<struct cm_context *>(wl_resource_get_user_data(resource));
@@ -417,7 +1608,7 @@ static void cm_desktop_surface_activate(struct wl_client *client, struct wl_reso
 			break;
 		}
 	}
-	ctx->send_update_surface();
+	ctx->schedule_surfaces_update(true);
 }
 
 static void cm_output_set_scale(struct wl_client *client, struct wl_resource *resource,
@@ -436,12 +1627,99 @@ static void cm_output_set_scale(struct wl_client *client, struct wl_resource *re
 	ctx->send_update_output();
 }
 
+static void cm_layout_output(struct wl_client *client, struct wl_resource *resource,
+                             const char *name, uint32_t enabled, int32_t x, int32_t y,
+                             int32_t width, int32_t height, int32_t refresh, wl_fixed_t scale,
+                             int32_t transform) {
+	if (transform < WL_OUTPUT_TRANSFORM_NORMAL || transform > WL_OUTPUT_TRANSFORM_FLIPPED_270) {
+		wl_resource_post_error(resource, WLDIP_COMPOSITOR_MANAGER_ERROR_INVALID_LAYOUT,
+		                       "invalid transform %d for output %s", transform, name);
+		return;
+	}
+	// the scale of an output that's going to be disabled doesn't matter
+	if (enabled && wl_fixed_to_double(scale) < 1.0) {
+		wl_resource_post_error(resource, WLDIP_COMPOSITOR_MANAGER_ERROR_INVALID_LAYOUT,
+		                       "invalid scale %f for output %s", wl_fixed_to_double(scale), name);
+		return;
+	}
+	auto *ctx = static_cast<struct cm_context *>(wl_resource_get_user_data(resource));
+	ctx->pending_layouts[resource].push_back(cm_output_config{
+	    name, !!enabled, x, y, width, height, refresh, wl_fixed_to_double(scale), transform});
+}
+
+static void cm_ping_clients(struct wl_client *client, struct wl_resource *resource) {
+	auto *ctx = static_cast<struct cm_context *>(wl_resource_get_user_data(resource));
+	ctx->ping_clients();
+}
+
+static bool check_trace_cap(struct wl_client *client, struct wl_resource *resource) {
+	auto *ctx = static_cast<struct cm_context *>(wl_resource_get_user_data(resource));
+	// without the capabilities plugin nobody can be granted the capability
+	if (caps_api == nullptr || !caps_api->check(caps_api->get(ctx->compositor), client, cap_trace)) {
+		wl_resource_post_error(resource, WLDIP_COMPOSITOR_MANAGER_ERROR_DENIED_CAPABILITY,
+		                       "the trace requests need the compositor-management-trace capability");
+		return false;
+	}
+	return true;
+}
+
+static void cm_dump_trace(struct wl_client *client, struct wl_resource *resource) {
+	auto *ctx = static_cast<struct cm_context *>(wl_resource_get_user_data(resource));
+	if (!check_trace_cap(client, resource)) {
+		return;
+	}
+	int fd = shm_open(SHM_ANON, O_RDWR | O_CREAT, 0644);
+	if (fd < 0) {
+		wl_resource_post_error(resource, WLDIP_COMPOSITOR_MANAGER_ERROR_TRACE_FAILED,
+		                       "could not create the trace dump file");
+		return;
+	}
+	// if the dump can't be written, the client gets an empty trace instead of waiting forever
+	int out_fd = dup(fd);
+	FILE *out = out_fd < 0 ? nullptr : fdopen(out_fd, "w");
+	if (out != nullptr) {
+		extra_dip_trace_dump(ctx->compositor, out);
+		fclose(out);
+	} else if (out_fd >= 0) {
+		close(out_fd);
+	}
+	lseek(fd, 0, SEEK_SET);
+	wldip_compositor_manager_send_trace(resource, fd);
+	close(fd);
+}
+
+static void cm_set_trace_level(struct wl_client *client, struct wl_resource *resource,
+                               uint32_t level) {
+	auto *ctx = static_cast<struct cm_context *>(wl_resource_get_user_data(resource));
+	if (!check_trace_cap(client, resource)) {
+		return;
+	}
+	extra_dip_trace_set_level(ctx->compositor, level);
+}
+
+static void cm_layout_apply(struct wl_client *client, struct wl_resource *resource) {
+	auto *ctx = static_cast<struct cm_context *>(wl_resource_get_user_data(resource));
+	auto it = ctx->pending_layouts.find(resource);
+	if (it == ctx->pending_layouts.end()) {
+		return;
+	}
+	std::string error = ctx->check_layout(it->second);
+	if (!error.empty()) {
+		wl_resource_post_error(resource, WLDIP_COMPOSITOR_MANAGER_ERROR_INVALID_LAYOUT, "%s",
+		                       error.c_str());
+		return;
+	}
+	ctx->apply_layout(it->second);
+	ctx->pending_layouts.erase(it);
+}
+
 static void cm_device_set_tap_click(struct wl_client *client, struct wl_resource *resource,
                                     uint32_t seat_idx, uint32_t device_idx, uint32_t enable) {
 	auto *ctx = static_cast<struct cm_context *>(wl_resource_get_user_data(resource));
-	ctx->with_input_device(seat_idx, device_idx, [enable](const struct evdev_device *device) {
+	ctx->with_input_device(seat_idx, device_idx, [ctx, enable](const struct evdev_device *device) {
 		libinput_device_config_tap_set_enabled(
 		    device->device, !!enable ? LIBINPUT_CONFIG_TAP_ENABLED : LIBINPUT_CONFIG_TAP_DISABLED);
+		ctx->device_settings.store(device->device, CM_DEVICE_TAP_CLICK);
 	});
 	ctx->send_update_inputdevs();
 }
@@ -449,9 +1727,10 @@ static void cm_device_set_tap_click(struct wl_client *client, struct wl_resource
 static void cm_device_set_tap_drag(struct wl_client *client, struct wl_resource *resource,
                                    uint32_t seat_idx, uint32_t device_idx, uint32_t enable) {
 	auto *ctx = static_cast<struct cm_context *>(wl_resource_get_user_data(resource));
-	ctx->with_input_device(seat_idx, device_idx, [enable](const struct evdev_device *device) {
+	ctx->with_input_device(seat_idx, device_idx, [ctx, enable](const struct evdev_device *device) {
 		libinput_device_config_tap_set_drag_enabled(
 		    device->device, !!enable ? LIBINPUT_CONFIG_DRAG_ENABLED : LIBINPUT_CONFIG_DRAG_DISABLED);
+		ctx->device_settings.store(device->device, CM_DEVICE_TAP_DRAG);
 	});
 	ctx->send_update_inputdevs();
 }
@@ -459,10 +1738,11 @@ static void cm_device_set_tap_drag(struct wl_client *client, struct wl_resource
 static void cm_device_set_drag_lock(struct wl_client *client, struct wl_resource *resource,
                                     uint32_t seat_idx, uint32_t device_idx, uint32_t enable) {
 	auto *ctx = static_cast<struct cm_context *>(wl_resource_get_user_data(resource));
-	ctx->with_input_device(seat_idx, device_idx, [enable](const struct evdev_device *device) {
+	ctx->with_input_device(seat_idx, device_idx, [ctx, enable](const struct evdev_device *device) {
 		libinput_device_config_tap_set_drag_lock_enabled(
 		    device->device,
 		    !!enable ? LIBINPUT_CONFIG_DRAG_LOCK_ENABLED : LIBINPUT_CONFIG_DRAG_LOCK_DISABLED);
+		ctx->device_settings.store(device->device, CM_DEVICE_DRAG_LOCK);
 	});
 	ctx->send_update_inputdevs();
 }
@@ -470,8 +1750,9 @@ static void cm_device_set_drag_lock(struct wl_client *client, struct wl_resource
 static void cm_device_set_send_events_mode(struct wl_client *client, struct wl_resource *resource,
                                            uint32_t seat_idx, uint32_t device_idx, uint32_t mode) {
 	auto *ctx = static_cast<struct cm_context *>(wl_resource_get_user_data(resource));
-	ctx->with_input_device(seat_idx, device_idx, [mode](const struct evdev_device *device) {
+	ctx->with_input_device(seat_idx, device_idx, [ctx, mode](const struct evdev_device *device) {
 		libinput_device_config_send_events_set_mode(device->device, mode);
+		ctx->device_settings.store(device->device, CM_DEVICE_SEND_EVENTS_MODE);
 	});
 	ctx->send_update_inputdevs();
 }
@@ -479,8 +1760,9 @@ static void cm_device_set_send_events_mode(struct wl_client *client, struct wl_r
 static void cm_device_set_accel_speed(struct wl_client *client, struct wl_resource *resource,
                                       uint32_t seat_idx, uint32_t device_idx, wl_fixed_t speed) {
 	auto *ctx = static_cast<struct cm_context *>(wl_resource_get_user_data(resource));
-	ctx->with_input_device(seat_idx, device_idx, [speed](const struct evdev_device *device) {
+	ctx->with_input_device(seat_idx, device_idx, [ctx, speed](const struct evdev_device *device) {
 		libinput_device_config_accel_set_speed(device->device, wl_fixed_to_double(speed));
+		ctx->device_settings.store(device->device, CM_DEVICE_ACCEL_SPEED);
 	});
 	ctx->send_update_inputdevs();
 }
@@ -488,9 +1770,10 @@ static void cm_device_set_accel_speed(struct wl_client *client, struct wl_resour
 static void cm_device_set_accel_profile(struct wl_client *client, struct wl_resource *resource,
                                         uint32_t seat_idx, uint32_t device_idx, uint32_t profile) {
 	auto *ctx = static_cast<struct cm_context *>(wl_resource_get_user_data(resource));
-	ctx->with_input_device(seat_idx, device_idx, [profile](const struct evdev_device *device) {
+	ctx->with_input_device(seat_idx, device_idx, [ctx, profile](const struct evdev_device *device) {
 		libinput_device_config_accel_set_profile(
 		    device->device, static_cast<enum libinput_config_accel_profile>(profile));
+		ctx->device_settings.store(device->device, CM_DEVICE_ACCEL_PROFILE);
 	});
 	ctx->send_update_inputdevs();
 }
@@ -499,8 +1782,9 @@ static void cm_device_set_natural_scrolling(struct wl_client *client, struct wl_
                                             uint32_t seat_idx, uint32_t device_idx,
                                             uint32_t enable) {
 	auto *ctx = static_cast<struct cm_context *>(wl_resource_get_user_data(resource));
-	ctx->with_input_device(seat_idx, device_idx, [enable](const struct evdev_device *device) {
+	ctx->with_input_device(seat_idx, device_idx, [ctx, enable](const struct evdev_device *device) {
 		libinput_device_config_scroll_set_natural_scroll_enabled(device->device, !!enable);
+		ctx->device_settings.store(device->device, CM_DEVICE_NATURAL_SCROLLING);
 	});
 	ctx->send_update_inputdevs();
 }
@@ -509,8 +1793,9 @@ static void cm_device_set_left_handed_mode(struct wl_client *client, struct wl_r
                                            uint32_t seat_idx, uint32_t device_idx,
                                            uint32_t enable) {
 	auto *ctx = static_cast<struct cm_context *>(wl_resource_get_user_data(resource));
-	ctx->with_input_device(seat_idx, device_idx, [enable](const struct evdev_device *device) {
+	ctx->with_input_device(seat_idx, device_idx, [ctx, enable](const struct evdev_device *device) {
 		libinput_device_config_left_handed_set(device->device, !!enable);
+		ctx->device_settings.store(device->device, CM_DEVICE_LEFT_HANDED);
 	});
 	ctx->send_update_inputdevs();
 }
@@ -518,9 +1803,10 @@ static void cm_device_set_left_handed_mode(struct wl_client *client, struct wl_r
 static void cm_device_set_click_method(struct wl_client *client, struct wl_resource *resource,
                                        uint32_t seat_idx, uint32_t device_idx, uint32_t method) {
 	auto *ctx = static_cast<struct cm_context *>(wl_resource_get_user_data(resource));
-	ctx->with_input_device(seat_idx, device_idx, [method](const struct evdev_device *device) {
+	ctx->with_input_device(seat_idx, device_idx, [ctx, method](const struct evdev_device *device) {
 		libinput_device_config_click_set_method(device->device,
 		                                        static_cast<enum libinput_config_click_method>(method));
+		ctx->device_settings.store(device->device, CM_DEVICE_CLICK_METHOD);
 	});
 	ctx->send_update_inputdevs();
 }
@@ -528,9 +1814,10 @@ static void cm_device_set_click_method(struct wl_client *client, struct wl_resou
 static void cm_device_set_scroll_method(struct wl_client *client, struct wl_resource *resource,
                                         uint32_t seat_idx, uint32_t device_idx, uint32_t method) {
 	auto *ctx = static_cast<struct cm_context *>(wl_resource_get_user_data(resource));
-	ctx->with_input_device(seat_idx, device_idx, [method](const struct evdev_device *device) {
+	ctx->with_input_device(seat_idx, device_idx, [ctx, method](const struct evdev_device *device) {
 		libinput_device_config_scroll_set_method(
 		    device->device, static_cast<enum libinput_config_scroll_method>(method));
+		ctx->device_settings.store(device->device, CM_DEVICE_SCROLL_METHOD);
 	});
 	ctx->send_update_inputdevs();
 }
@@ -539,10 +1826,11 @@ static void cm_device_set_middle_emulation(struct wl_client *client, struct wl_r
                                            uint32_t seat_idx, uint32_t device_idx,
                                            uint32_t enable) {
 	auto *ctx = static_cast<struct cm_context *>(wl_resource_get_user_data(resource));
-	ctx->with_input_device(seat_idx, device_idx, [enable](const struct evdev_device *device) {
+	ctx->with_input_device(seat_idx, device_idx, [ctx, enable](const struct evdev_device *device) {
 		libinput_device_config_middle_emulation_set_enabled(
 		    device->device, !!enable ? LIBINPUT_CONFIG_MIDDLE_EMULATION_ENABLED
 		                             : LIBINPUT_CONFIG_MIDDLE_EMULATION_DISABLED);
+		ctx->device_settings.store(device->device, CM_DEVICE_MIDDLE_EMULATION);
 	});
 	ctx->send_update_inputdevs();
 }
@@ -550,9 +1838,10 @@ static void cm_device_set_middle_emulation(struct wl_client *client, struct wl_r
 static void cm_device_set_dwt(struct wl_client *client, struct wl_resource *resource,
                               uint32_t seat_idx, uint32_t device_idx, uint32_t enable) {
 	auto *ctx = static_cast<struct cm_context *>(wl_resource_get_user_data(resource));
-	ctx->with_input_device(seat_idx, device_idx, [enable](const struct evdev_device *device) {
+	ctx->with_input_device(seat_idx, device_idx, [ctx, enable](const struct evdev_device *device) {
 		libinput_device_config_dwt_set_enabled(
 		    device->device, !!enable ? LIBINPUT_CONFIG_DWT_ENABLED : LIBINPUT_CONFIG_DWT_DISABLED);
+		ctx->device_settings.store(device->device, CM_DEVICE_DWT);
 	});
 	ctx->send_update_inputdevs();
 }
@@ -562,6 +1851,13 @@ static void cm_destructor(struct wl_resource *resource) {
 	ctx->surfaces_subscribers.erase(resource);
 	ctx->outputs_subscribers.erase(resource);
 	ctx->inputdevs_subscribers.erase(resource);
+	ctx->outputstats_subscribers.erase(resource);
+	ctx->flow.erase(resource);
+	ctx->pending_layouts.erase(resource);
+	auto &gets = ctx->pending_gets;
+	gets.erase(std::remove_if(gets.begin(), gets.end(),
+	                          [resource](const auto &pg) { return pg.second == resource; }),
+	           gets.end());
 }
 
 static struct wldip_compositor_manager_interface cm_impl = {
@@ -581,6 +1877,15 @@ static struct wldip_compositor_manager_interface cm_impl = {
     cm_device_set_scroll_method,
     cm_device_set_middle_emulation,
     cm_device_set_dwt,
+    cm_ack,
+    cm_query_surfaces,
+    cm_query_input_device,
+    cm_query_head,
+    cm_layout_output,
+    cm_layout_apply,
+    cm_ping_clients,
+    cm_dump_trace,
+    cm_set_trace_level,
 };
 
 static void bind_manager(struct wl_client *client, void *data, uint32_t version, uint32_t id) {
@@ -590,8 +1895,30 @@ static void bind_manager(struct wl_client *client, void *data, uint32_t version,
 	wl_resource_set_implementation(resource, &cm_impl, data, cm_destructor);
 }
 
+static int on_trace_signal(int signal_number, void *data) {
+	auto *compositor = static_cast<struct weston_compositor *>(data);
+	char *dump = nullptr;
+	size_t len = 0;
+	FILE *out = open_memstream(&dump, &len);
+	extra_dip_trace_dump(compositor, out);
+	fclose(out);
+	weston_log("compositor-management: trace dump:\n%s", dump);
+	free(dump);
+	return 0;
+}
+
 WL_EXPORT int wet_module_init(struct weston_compositor *compositor, int *argc, char *argv[]) {
+	if ((caps_api = weston_extra_dip_capabilities_get_api_v2(compositor)) != nullptr) {
+		cap_trace = caps_api->create(caps_api->get(compositor), "compositor-management-trace");
+	} else {
+		weston_log(
+		    "compositor-management: did not find capabilities api, the trace requests will be denied "
+		    "(put the capabilities plugin before this one to allow them)\n");
+	}
+	extra_dip_trace_init(compositor, &trace, EXTRA_DIP_TRACE_API_NAME("compositor-management"));
 	auto *ctx = new cm_context(compositor);
+	wl_event_loop_add_signal(wl_display_get_event_loop(compositor->wl_display), SIGUSR2,
+	                         on_trace_signal, compositor);
 	wl_global_create(compositor->wl_display, &wldip_compositor_manager_interface, 1,
 	                 reinterpret_cast<void *>(ctx), bind_manager);
 	return 0;
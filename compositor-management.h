@@ -0,0 +1,502 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+#include "Management_generated.h"
+#include "weston-extra-dip-trace.h"
+
+// Ring of the most recent samples, percentiles are computed when serializing
+template <size_t N>
+struct cm_sample_window {
+	std::array<uint32_t, N> ring{};
+	size_t pos = 0;
+	size_t count = 0;
+
+	void push(uint32_t sample) {
+		ring[pos] = sample;
+		pos = (pos + 1) % N;
+		count = std::min(count + 1, N);
+	}
+
+	uint32_t max() const {
+		return count == 0 ? 0 : *std::max_element(ring.begin(), ring.begin() + count);
+	}
+
+	uint32_t percentile(size_t pct) const {
+		if (count == 0) {
+			return 0;
+		}
+		std::array<uint32_t, N> sorted;
+		std::copy_n(ring.begin(), count, sorted.begin());
+		auto nth = sorted.begin() + std::min(count - 1, count * pct / 100);
+		std::nth_element(sorted.begin(), nth, sorted.begin() + count);
+		return *nth;
+	}
+};
+
+extern "C" {
+#include <compositor.h>
+
+struct evdev_device;
+struct weston_desktop_shell_api;
+
+// Presentation gaps longer than this mean the output was idle, not that frames were missed
+const int64_t cm_idle_interval_nsec = 250 * 1000000;
+const uint32_t cm_stats_interval_msec = 1000;
+const size_t cm_request_rate_window_sec = 10;
+// Desktop clients are pinged while someone is subscribed to surfaces
+const uint32_t cm_ping_interval_msec = 3000;
+const int64_t cm_unresponsive_nsec = 2000 * 1000000LL;
+const size_t cm_ping_window = 32;
+
+struct cm_context;
+
+struct cm_output_stats {
+	struct cm_context *ctx;
+	struct weston_output *output;
+	struct wl_listener frame_listener {};
+	struct timespec last_presentation {};
+	uint64_t repaints = 0;
+	uint64_t missed_vblanks = 0;
+	cm_sample_window<512> repaint_us;
+	cm_sample_window<512> present_interval_us;
+
+	cm_output_stats(struct cm_context *c, struct weston_output *o);
+	~cm_output_stats();
+
+	// Called after the output has been repainted: next_repaint is when the repaint was started,
+	// frame_time is the presentation timestamp of the previous frame
+	void record_repaint();
+
+	cm_output_stats(cm_output_stats &&) = delete;
+};
+
+// Counters are maintained from resource create/destroy and protocol logger callbacks,
+// except views (there's no signal for view creation) which are counted while serializing
+struct cm_client_stats {
+	struct cm_context *ctx;
+	struct wl_client *client;
+	pid_t pid = 0;
+	uid_t uid = 0;
+	uint32_t surfaces = 0;
+	uint32_t views = 0;
+	uint32_t resources = 0;
+	uint64_t shm_bytes = 0;
+	std::array<uint32_t, cm_request_rate_window_sec> request_buckets{};
+	uint64_t newest_bucket_sec = 0;
+	cm_sample_window<cm_ping_window> ping_us;
+	uint32_t last_ping_us = 0;
+	struct timespec ping_sent {};
+	bool ping_pending = false;
+	bool unresponsive = false;
+	struct wl_listener destroy_listener {};
+	struct wl_listener resource_created_listener {};
+
+	cm_client_stats(struct cm_context *c, struct wl_client *cl);
+	~cm_client_stats();
+
+	void advance_buckets(uint64_t now_sec) {
+		if (now_sec <= newest_bucket_sec) {
+			return;
+		}
+		for (uint64_t sec = newest_bucket_sec + 1;
+		     sec <= now_sec && sec <= newest_bucket_sec + cm_request_rate_window_sec; sec++) {
+			request_buckets[sec % cm_request_rate_window_sec] = 0;
+		}
+		newest_bucket_sec = now_sec;
+	}
+
+	void count_request(uint64_t now_sec) {
+		advance_buckets(now_sec);
+		request_buckets[now_sec % cm_request_rate_window_sec]++;
+	}
+
+	uint32_t requests_per_sec(uint64_t now_sec) {
+		advance_buckets(now_sec);
+		uint32_t total = 0;
+		for (auto bucket : request_buckets) {
+			total += bucket;
+		}
+		return total / cm_request_rate_window_sec;
+	}
+
+	cm_client_stats(cm_client_stats &&) = delete;
+};
+
+// Attached to every resource of a tracked client to undo its contribution on destroy. Frame
+// callbacks are created every frame, so trackers are recycled through cm_context::free_trackers
+// instead of being allocated per resource. Buffers are inspected from an idle callback because
+// the shm implementation is only set after the resource created signal
+struct cm_resource_tracker {
+	struct cm_context *ctx;
+	struct wl_resource *resource;
+	bool is_surface = false;
+	uint64_t shm_bytes = 0;
+	struct wl_listener destroy_listener {};
+};
+
+// Strings that are too expensive to query on every update. They're refreshed when the client
+// sets its title or app_id and when the surface gets a role
+struct cm_surface_meta {
+	struct cm_context *ctx;
+	struct weston_surface *surface;
+	struct wl_client *client = nullptr;
+	const char *role_name = nullptr;
+	wldip::compositor_management::Role role = wldip::compositor_management::Role_Other;
+	bool is_desktop = false;
+	bool mapped = false;
+	bool stale = false;
+	bool committed = false;
+	std::string label;
+	std::string title;
+	std::string app_id;
+	struct wl_listener destroy_listener {};
+
+	cm_surface_meta(struct cm_context *c, struct weston_surface *s);
+	~cm_surface_meta();
+
+	// Returns whether anything visible to subscribers changed
+	bool refresh();
+
+	cm_surface_meta(cm_surface_meta &&) = delete;
+};
+
+// Subscribers that have sent an ack are flow controlled: while one of their updates is
+// unacknowledged, newer states are only marked as pending and one update with the latest
+// state is sent when they catch up, so a stalled client doesn't accumulate fds
+struct cm_subscriber_flow {
+	// counted from the first update, so acks for updates sent before the first ack match up
+	uint32_t unacked = 0;
+	bool acks = false;
+	bool pending = false;
+};
+
+// Plain copies of everything that goes into a CompositorState, captured on the main thread so
+// that serializing needs no compositor state. Strings live in one arena, records refer to them
+struct cm_snap_str {
+	uint32_t off = 0;
+	uint32_t len = 0;
+};
+
+struct cm_snap_head {
+	cm_snap_str name, make, model, serial_number;
+	int32_t output_id;
+	int32_t mm_width, mm_height;
+	uint32_t subpixel;
+	bool connection_internal, connected, non_desktop;
+};
+
+struct cm_snap_output {
+	uint32_t id;
+	cm_snap_str name;
+	int32_t x, y, width, height;
+	float current_scale, original_scale;
+	bool has_stats;
+	uint64_t repaints, missed_vblanks;
+	uint32_t repaint_us_p50, repaint_us_p99, repaint_us_max;
+	uint32_t present_interval_us_p50, present_interval_us_p99, present_interval_us_max;
+	uint32_t window_size;
+};
+
+struct cm_snap_input_device {
+	uint32_t product_id, vendor_id;
+	double mm_width, mm_height;
+	int32_t touch_count, tap_finger_count;
+	bool tap_click_default, tap_click;
+	uint32_t tap_button_map, tap_button_map_default;
+	bool tap_drag_default, tap_drag, drag_lock_default, drag_lock;
+	uint32_t send_events_mode_default, send_events_mode;
+	double accel_speed_default, accel_speed;
+	uint32_t accel_profile_default, accel_profile;
+	bool natural_scrolling_available, natural_scrolling_default, natural_scrolling;
+	bool left_handed_available, left_handed_default, left_handed;
+	std::array<uint32_t, 3> click_methods;
+	uint32_t n_click_methods;
+	uint32_t click_method_default, click_method;
+	bool middle_emulation_available, middle_emulation_default, middle_emulation;
+	std::array<uint32_t, 4> scroll_methods;
+	uint32_t n_scroll_methods;
+	uint32_t scroll_method_default, scroll_method;
+	uint32_t scroll_button_default, scroll_button;
+	bool dwt_available, dwt_default, dwt;
+	bool rotation_available;
+	uint32_t rotation_default, rotation;
+	std::array<uint8_t, 7> capabilities;
+	uint32_t n_capabilities;
+	cm_snap_str name, system_name;
+};
+
+struct cm_snap_seat {
+	cm_snap_str name;
+	uint32_t first_device, n_devices;
+};
+
+struct cm_snap_surface {
+	uint64_t uid;
+	wldip::compositor_management::Role role;
+	cm_snap_str role_name, label;
+	bool has_output;
+	int32_t primary_output_id;
+	bool has_client;
+	uint64_t client_pid;
+	bool is_desktop;
+	cm_snap_str title, app_id;
+	uint64_t pid;
+	bool activated, maximized, fullscreen, resizing;
+	int32_t max_width, max_height, min_width, min_height;
+	uint32_t ping_last_us, ping_max_us, ping_p95_us;
+	bool unresponsive;
+};
+
+struct cm_snap_client {
+	uint64_t pid;
+	uint32_t uid, surfaces, views, resources;
+	uint64_t shm_bytes;
+	uint32_t requests_per_sec;
+};
+
+struct cm_snapshot {
+	int32_t kb_repeat_rate = 0;
+	int32_t kb_repeat_delay = 0;
+	std::vector<char> strings;
+	std::vector<cm_snap_head> heads;
+	std::vector<cm_snap_output> outputs;
+	std::vector<cm_snap_seat> seats;
+	std::vector<cm_snap_input_device> input_devices;
+	std::vector<cm_snap_surface> surfaces;
+	std::vector<cm_snap_client> clients;
+	// role names are static strings shared by many surfaces, each one is only copied once
+	std::vector<std::pair<const char *, cm_snap_str>> role_names;
+
+	// Keeps the capacity, a steady state is captured without allocating
+	void clear();
+	cm_snap_str add_string(const char *str, size_t len);
+	cm_snap_str add_string(const char *str);
+	cm_snap_str add_role_name(const char *role_name);
+};
+
+// Turns snapshots into CompositorState buffers. The builder and offset vectors are kept across
+// updates, once they've grown to fit the state serializing doesn't allocate
+struct cm_serializer {
+	flatbuffers::FlatBufferBuilder builder{4096};
+	std::vector<flatbuffers::Offset<wldip::compositor_management::Head>> heads;
+	std::vector<flatbuffers::Offset<wldip::compositor_management::Output>> outputs;
+	std::vector<flatbuffers::Offset<wldip::compositor_management::Seat>> seats;
+	std::vector<flatbuffers::Offset<wldip::compositor_management::InputDevice>> inputs;
+	std::vector<flatbuffers::Offset<wldip::compositor_management::Surface>> surfaces;
+	std::vector<flatbuffers::Offset<wldip::compositor_management::Client>> clients;
+	std::vector<std::pair<uint64_t, flatbuffers::Offset<flatbuffers::String>>> role_names;
+
+	void serialize(const cm_snapshot &snap);
+	// Returns a descriptor to a shared memory copy of the last serialized state
+	int write() const;
+};
+
+// Updates for subscribers of topic, or the reply to the get request identified by token
+struct cm_job {
+	cm_snapshot *snap;
+	uint32_t topic;
+	uint32_t token;
+	int fd;
+	struct timespec queued;
+};
+
+// Serializes snapshots off the compositor thread, in order. Finished jobs are handed back
+// through an eventfd and fanned out to subscribers from the main loop
+struct cm_worker {
+	cm_serializer serializer;
+	std::thread thread;
+	std::mutex lock;
+	std::condition_variable wakeup;
+	std::vector<cm_job> queued;
+	std::vector<cm_job> done;
+	bool stopping = false;
+	int event_fd = -1;
+
+	void run();
+};
+
+// One output of a layout request
+struct cm_output_config {
+	std::string name;
+	bool enabled;
+	int32_t x, y, width, height, refresh;
+	double scale;
+	int32_t transform;
+};
+
+// Bits of cm_device_settings::set, only the options set through compositor-management are stored
+enum cm_device_option : uint32_t {
+	CM_DEVICE_TAP_CLICK = 1 << 0,
+	CM_DEVICE_TAP_DRAG = 1 << 1,
+	CM_DEVICE_DRAG_LOCK = 1 << 2,
+	CM_DEVICE_SEND_EVENTS_MODE = 1 << 3,
+	CM_DEVICE_ACCEL_SPEED = 1 << 4,
+	CM_DEVICE_ACCEL_PROFILE = 1 << 5,
+	CM_DEVICE_NATURAL_SCROLLING = 1 << 6,
+	CM_DEVICE_LEFT_HANDED = 1 << 7,
+	CM_DEVICE_CLICK_METHOD = 1 << 8,
+	CM_DEVICE_SCROLL_METHOD = 1 << 9,
+	CM_DEVICE_MIDDLE_EMULATION = 1 << 10,
+	CM_DEVICE_DWT = 1 << 11,
+};
+
+const uint32_t cm_device_settings_magic = 0x53444d43;  // "CMDS"
+const uint32_t cm_device_settings_version = 1;
+const size_t cm_device_settings_max = 128;
+const size_t cm_device_name_max = 64;
+
+struct cm_device_settings {
+	uint32_t vendor_id, product_id;
+	char name[cm_device_name_max];
+	uint32_t set;
+	uint32_t tap_click, tap_drag, drag_lock, send_events_mode, accel_profile;
+	uint32_t natural_scrolling, left_handed, click_method, scroll_method, middle_emulation, dwt;
+	double accel_speed;
+};
+
+struct cm_device_settings_file {
+	uint32_t magic, version, count, reserved;
+	cm_device_settings records[cm_device_settings_max];
+};
+
+// Per device options keyed by vendor, product and name, in a file that's mmap'd shared so stores
+// are written through by the kernel. Stored options are applied as soon as a device shows up
+struct cm_device_settings_store {
+	cm_device_settings_file *file = nullptr;
+	// Devices present at the last hotplug, a device that's missing from applied is new
+	std::unordered_set<struct libinput_device *> applied, seen;
+
+	// Persistence is disabled when the file can't be opened
+	void open(const char *path);
+	// Returns nullptr when the device has no record and create is unset, or the table is full
+	cm_device_settings *find(struct libinput_device *device, bool create);
+	// Records the current value of option
+	void store(struct libinput_device *device, cm_device_option option);
+	void apply(struct libinput_device *device);
+};
+
+struct cm_context {
+	struct weston_compositor *compositor;
+	const struct weston_desktop_shell_api *desk_shell;
+	std::unordered_set<wl_resource *> surfaces_subscribers;
+	std::unordered_set<wl_resource *> outputs_subscribers;
+	std::unordered_set<wl_resource *> inputdevs_subscribers;
+	std::unordered_set<wl_resource *> outputstats_subscribers;
+	std::unordered_map<wl_resource *, cm_subscriber_flow> flow;
+	std::unordered_map<struct weston_output *, std::unique_ptr<cm_output_stats>> output_stats;
+	struct wl_event_source *stats_timer = nullptr;
+	bool stats_timer_armed = false;
+	struct wl_event_source *ping_timer = nullptr;
+	bool ping_timer_armed = false;
+	std::unordered_map<struct wl_client *, std::unique_ptr<cm_client_stats>> clients;
+	std::vector<struct cm_resource_tracker *> free_trackers;
+	std::vector<struct cm_resource_tracker *> uninspected_buffers;
+	struct wl_event_source *inspect_buffers_idle = nullptr;
+	std::unordered_map<struct weston_surface *, std::unique_ptr<cm_surface_meta>> surface_meta;
+	struct wl_event_source *surfaces_idle = nullptr;
+	bool surfaces_changed = false;
+	// Only committed surfaces can have been mapped or unmapped since the last repaint, all of them
+	// are rechecked when a role object is destroyed or metadata is stale
+	std::vector<struct weston_surface *> committed_surfaces;
+	bool surfaces_recheck = false;
+	struct wl_listener client_created_listener {};
+	struct wl_listener create_surface_listener {};
+	struct wl_listener activate_listener {};
+	struct wl_listener output_created_listener {};
+	struct wl_listener output_destroyed_listener {};
+	struct wl_listener output_moved_listener {};
+	struct wl_listener output_resized_listener {};
+	struct wl_listener output_heads_changed_listener {};
+	struct wl_listener input_devices_changed_listener {};
+	struct wl_listener compositor_destroy_listener {};
+
+	// Used on the main thread for make_update and query results
+	cm_snapshot local_snapshot;
+	cm_serializer local_serializer;
+	std::vector<struct weston_surface *> surface_ptrs;
+	cm_worker worker;
+	struct wl_event_source *worker_source = nullptr;
+	std::vector<std::unique_ptr<cm_snapshot>> spare_snapshots;
+	std::vector<cm_job> finished;
+	std::vector<std::pair<uint32_t, struct wl_resource *>> pending_gets;
+	uint32_t next_token = 0;
+	cm_device_settings_store device_settings;
+	std::unordered_map<struct wl_resource *, std::vector<cm_output_config>> pending_layouts;
+	bool applying_layout = false;
+
+	cm_context(struct weston_compositor *c);
+
+	void track_client(struct wl_client *client);
+	cm_client_stats *client_stats_for(struct weston_surface *surface);
+	cm_surface_meta *meta_for(struct weston_surface *surface);
+	// Called before the client's metadata request is handled
+	void invalidate_meta(struct wl_client *client);
+	void track_output(struct weston_output *output);
+	void untrack_output(struct weston_output *output);
+
+	// Surface events are coalesced into one update per main loop iteration. Mapping and unmapping
+	// has no signal, so the idle callback also compares the mapped state of every surface
+	void schedule_surfaces_update(bool changed);
+	void mark_committed(struct weston_surface *surface);
+
+	// Stats are sent at most once per interval, and only while outputs are being repainted
+	void schedule_stats_update();
+
+	// Pings are seen in the protocol logger, so the ones sent by the shell are measured too
+	void schedule_ping();
+	void ping_clients();
+	void record_ping(struct wl_client *client);
+	void record_pong(struct wl_client *client);
+
+	// Capturing copies compositor state into a snapshot, for the whole state and for query results
+	void capture_head(cm_snapshot &snap, struct weston_head *head);
+	void capture_output(cm_snapshot &snap, struct weston_output *output);
+	void capture_input_device(cm_snapshot &snap, struct evdev_device *device);
+	void capture_surface(cm_snapshot &snap, struct weston_surface *surface);
+	// Fills surface_ptrs with every surface that has a view and counts client views
+	void collect_surfaces();
+	void capture_state(cm_snapshot &snap);
+
+	// Synchronous capture and serialization on the main thread
+	int make_update();
+
+	// Captures the state and queues it for the worker
+	void queue_update(uint32_t topic, uint32_t token);
+	void stop_worker();
+
+	bool can_deliver(struct wl_resource *resource);
+	void deliver(struct wl_resource *resource, int fd);
+	void send_update_to(struct wl_resource *resource);
+	// Captures the state only if at least one of the subscribers can receive it
+	void broadcast(uint32_t topic);
+	// Fans out finished jobs
+	void dispatch_finished();
+	const std::unordered_set<struct wl_resource *> &subscribers(uint32_t topic);
+	void send_update_surface();
+	void send_update_output();
+	void send_update_inputdevs();
+	void send_update_outputstats();
+	void with_input_device(uint32_t seat_idx, uint32_t device_idx,
+	                       const std::function<void(evdev_device *)> &f);
+	// Returns why the layout can't be applied, or an empty string if it can
+	std::string check_layout(const std::vector<cm_output_config> &layout);
+	// Applies a whole layout with output updates held back until the end, so that subscribers get
+	// one update and outputs get one repaint. The layout must have passed check_layout
+	void apply_layout(const std::vector<cm_output_config> &layout);
+	// Applies stored options to devices that weren't there the last time this was called
+	void apply_device_settings();
+
+	cm_context(cm_context &&) = delete;
+};
+}
@@ -4,9 +4,12 @@
 #include <unistd.h>
 #include <wayland-client.h>
 #include <webp/encode.h>
+#include <algorithm>
+#include <chrono>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <vector>
 #include "Management_generated.h"
 #include "wldip-compositor-manager-client-protocol.h"
 
@@ -122,12 +125,8 @@ static std::string capability_name(wldip::compositor_management::DeviceCapabilit
 
 static uint64_t updates_recvd = 0;
 
-static void on_update(void *data, struct wldip_compositor_manager *shooter, int recv_fd) {
+static void print_state(const wldip::compositor_management::CompositorState *state) {
 	using namespace wldip::compositor_management;
-	struct stat recv_stat {};
-	fstat(recv_fd, &recv_stat);
-	void *fbuf = mmap(nullptr, recv_stat.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, recv_fd, 0);
-	const auto state = GetCompositorState(fbuf);
 	std::cout.imbue(std::locale("C"));
 	std::cout << std::boolalpha;
 	std::cout << "Keyboard repeat rate: " << state->kb_repeat_rate() << std::endl;
@@ -258,6 +257,7 @@ static void on_update(void *data, struct wldip_compositor_manager *shooter, int
 			}
 			std::cout << "  Role: " << role << std::endl;
 			std::cout << "  Primary output: " << surface->primary_output_id() << std::endl;
+			std::cout << "  Client PID: " << surface->client_pid() << std::endl;
 			if (surface->desktop() != nullptr) {
 				std::cout << "  Desktop surface data:" << std::endl;
 				auto dsurf = surface->desktop();
@@ -272,18 +272,193 @@ static void on_update(void *data, struct wldip_compositor_manager *shooter, int
 				          << std::endl;
 				std::cout << "    Min size: " << dsurf->min_width() << " x " << dsurf->min_height()
 				          << std::endl;
+				std::cout << "    Ping: last " << dsurf->ping_last_us() << " us, p95 "
+				          << dsurf->ping_p95_us() << " us, max " << dsurf->ping_max_us() << " us"
+				          << std::endl;
+				if (dsurf->unresponsive()) {
+					std::cout << "    UNRESPONSIVE" << std::endl;
+				}
 			}
 			std::cout << std::endl;
 		}
 
+		std::cout << "Clients [" << state->clients()->size() << "]:" << std::endl;
+		for (const auto client : *state->clients()) {
+			std::cout << "  PID: " << client->pid() << std::endl;
+			std::cout << "  UID: " << client->uid() << std::endl;
+			std::cout << "  Surfaces: " << client->surfaces() << std::endl;
+			std::cout << "  Views: " << client->views() << std::endl;
+			std::cout << "  Resources: " << client->resources() << std::endl;
+			std::cout << "  SHM buffers: " << client->shm_bytes() << " bytes" << std::endl;
+			std::cout << "  Requests: " << client->requests_per_sec() << " per second" << std::endl;
+			std::cout << std::endl;
+		}
+
 		std::cout << "--------" << std::endl;
 		std::cout << std::endl;
 	}
+}
+
+static void print_repaint_stats(const wldip::compositor_management::CompositorState *state) {
+	std::cout.imbue(std::locale("C"));
+	for (const auto output : *state->outputs()) {
+		std::cout << output->id() << " " << output->name()->str() << ":";
+		const auto stats = output->stats();
+		if (stats == nullptr || stats->window_size() == 0) {
+			std::cout << " no repaints yet" << std::endl;
+			continue;
+		}
+		std::cout << " repaints " << stats->repaints() << ", missed vblanks " << stats->missed_vblanks()
+		          << std::endl;
+		std::cout << "  Repaint: p50 " << stats->repaint_us_p50() << " us, p99 "
+		          << stats->repaint_us_p99() << " us, max " << stats->repaint_us_max() << " us"
+		          << std::endl;
+		std::cout << "  Presentation interval: p50 " << stats->present_interval_us_p50() << " us, p99 "
+		          << stats->present_interval_us_p99() << " us, max "
+		          << stats->present_interval_us_max() << " us" << std::endl;
+	}
+	std::cout << std::endl;
+}
+
+static void print_clients(const wldip::compositor_management::CompositorState *state) {
+	std::vector<const wldip::compositor_management::Client *> clients(state->clients()->begin(),
+	                                                                  state->clients()->end());
+	std::sort(clients.begin(), clients.end(),
+	          [](auto a, auto b) { return a->shm_bytes() > b->shm_bytes(); });
+	std::cout.imbue(std::locale("C"));
+	std::cout << std::setw(8) << "PID" << std::setw(16) << "SHM bytes" << std::setw(10) << "Surfaces"
+	          << std::setw(8) << "Views" << std::setw(11) << "Resources" << std::setw(10) << "Req/s"
+	          << std::endl;
+	for (const auto client : clients) {
+		std::cout << std::setw(8) << client->pid() << std::setw(16) << client->shm_bytes()
+		          << std::setw(10) << client->surfaces() << std::setw(8) << client->views()
+		          << std::setw(11) << client->resources() << std::setw(10) << client->requests_per_sec()
+		          << std::endl;
+	}
+}
+
+static void (*print_update)(const wldip::compositor_management::CompositorState *) = print_state;
+
+using bench_clock = std::chrono::steady_clock;
+
+template <typename T>
+static T percentile(std::vector<T> samples, size_t pct) {
+	if (samples.empty()) {
+		return T();
+	}
+	auto nth = samples.begin() + std::min(samples.size() - 1, samples.size() * pct / 100);
+	std::nth_element(samples.begin(), nth, samples.end());
+	return *nth;
+}
+
+template <typename T>
+static void print_percentiles(const char *what, const std::vector<T> &samples, const char *unit) {
+	std::cout << what << ": p50 " << percentile(samples, 50) << " " << unit << ", p90 "
+	          << percentile(samples, 90) << " " << unit << ", p99 " << percentile(samples, 99) << " "
+	          << unit << " (" << samples.size() << " samples)" << std::endl;
+}
+
+// Reads every string so that decoding isn't just the pointer cast GetCompositorState does
+static size_t walk_state(const wldip::compositor_management::CompositorState *state) {
+	size_t total = 0;
+	for (const auto seat : *state->seats()) {
+		total += seat->name()->size();
+		for (const auto device : *seat->input_devices()) {
+			total += device->name()->size() + device->system_name()->size() +
+			         device->available_click_methods()->size() +
+			         device->available_scroll_methods()->size() + device->capabilites()->size();
+		}
+	}
+	for (const auto output : *state->outputs()) {
+		total += output->name()->size();
+	}
+	for (const auto head : *state->heads()) {
+		total += head->name()->size() + head->make()->size() + head->model()->size() +
+		         head->serial_number()->size();
+	}
+	for (const auto surface : *state->surfaces()) {
+		total += surface->label()->size() + surface->other_role()->size();
+		if (surface->desktop() != nullptr) {
+			total += surface->desktop()->title()->size() + surface->desktop()->app_id()->size();
+		}
+	}
+	return total;
+}
+
+struct bench_stats {
+	bench_clock::time_point last_received;
+	std::vector<double> decode_us;
+	std::vector<size_t> sizes;
+	bool verify_failed = false;
+	bool has_output = false;
+	uint32_t output_id = 0;
+	float output_scale = 1;
+
+	void record_update(const void *fbuf, size_t size) {
+		using namespace wldip::compositor_management;
+		auto start = bench_clock::now();
+		flatbuffers::Verifier verifier(static_cast<const uint8_t *>(fbuf), size);
+		verify_failed = verify_failed || !VerifyCompositorStateBuffer(verifier);
+		const auto state = GetCompositorState(fbuf);
+		volatile size_t walked = walk_state(state);
+		(void)walked;
+		decode_us.push_back(
+		    std::chrono::duration<double, std::micro>(bench_clock::now() - start).count());
+		sizes.push_back(size);
+		if (!has_output && state->outputs()->size() > 0) {
+			has_output = true;
+			output_id = state->outputs()->Get(0)->id();
+			output_scale = state->outputs()->Get(0)->current_scale();
+		}
+	}
+};
+
+static bench_stats *bench = nullptr;
+
+static void on_update(void *data, struct wldip_compositor_manager *shooter, int recv_fd) {
+	using namespace wldip::compositor_management;
+	if (bench != nullptr) {
+		bench->last_received = bench_clock::now();
+	}
+	struct stat recv_stat {};
+	fstat(recv_fd, &recv_stat);
+	void *fbuf = mmap(nullptr, recv_stat.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, recv_fd, 0);
+	if (bench != nullptr) {
+		bench->record_update(fbuf, recv_stat.st_size);
+	} else {
+		print_update(GetCompositorState(fbuf));
+	}
+	munmap(fbuf, recv_stat.st_size);
 	close(recv_fd);
 	updates_recvd++;
+	// watching is flow controlled, a slow terminal only gets the latest state
+	wldip_compositor_manager_ack(shooter);
 }
 
-static const struct wldip_compositor_manager_listener shooter_listener = {on_update};
+static void on_query_result(void *data, struct wldip_compositor_manager *shooter, uint32_t serial,
+                            int recv_fd) {
+	using namespace wldip::compositor_management;
+	struct stat recv_stat {};
+	fstat(recv_fd, &recv_stat);
+	void *fbuf = mmap(nullptr, recv_stat.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, recv_fd, 0);
+	print_update(GetCompositorState(fbuf));
+	munmap(fbuf, recv_stat.st_size);
+	close(recv_fd);
+	updates_recvd++;
+}
+
+static void on_trace(void *data, struct wldip_compositor_manager *shooter, int recv_fd) {
+	char buf[4096];
+	ssize_t n;
+	while ((n = read(recv_fd, buf, sizeof(buf))) > 0) {
+		std::cout.write(buf, n);
+	}
+	close(recv_fd);
+	updates_recvd++;
+}
+
+static const struct wldip_compositor_manager_listener shooter_listener = {
+    on_update, on_query_result, on_trace};
 
 int main(int argc, char *argv[]) {
 	struct wl_display *display = wl_display_connect(nullptr);
@@ -303,11 +478,57 @@ int main(int argc, char *argv[]) {
 
 	wldip_compositor_manager_add_listener(shooter, &shooter_listener, nullptr);
 
+	auto wait_update = [=](uint64_t count) {
+		while (updates_recvd < count && wl_display_dispatch(display) != -1) {
+		}
+	};
+
 	auto run_get = [=] {
 		wldip_compositor_manager_get(shooter);
-		while (updates_recvd < 1) {
-			wl_display_dispatch(display);
-			wl_display_roundtrip(display);
+		wait_update(updates_recvd + 1);
+	};
+
+	// Query results are counted like updates, the serial isn't needed with one query at a time
+	auto run_query_surfaces = [=](uint32_t filter, const char *text, uint32_t number) {
+		wldip_compositor_manager_query_surfaces(shooter, 0, filter, text, number);
+		wait_update(updates_recvd + 1);
+	};
+
+	// Times request -> update round trips, each sample waits for its update before the next request
+	auto run_bench = [=](uint32_t iterations) {
+		bench_stats stats;
+		bench = &stats;
+		std::vector<double> get_us, set_us;
+		// not subscribed yet, so the only updates are the replies to get
+		for (uint32_t i = 0; i < iterations; i++) {
+			auto start = bench_clock::now();
+			wldip_compositor_manager_get(shooter);
+			wait_update(updates_recvd + 1);
+			get_us.push_back(
+			    std::chrono::duration<double, std::micro>(stats.last_received - start).count());
+		}
+		wldip_compositor_manager_subscribe(shooter, WLDIP_COMPOSITOR_MANAGER_TOPIC_OUTPUTS);
+		for (uint32_t i = 0; i < iterations && stats.has_output; i++) {
+			auto start = bench_clock::now();
+			// setting the current scale still broadcasts a full update to outputs subscribers
+			wldip_compositor_manager_output_set_scale(shooter, stats.output_id,
+			                                          wl_fixed_from_double(stats.output_scale));
+			wait_update(updates_recvd + 1);
+			set_us.push_back(
+			    std::chrono::duration<double, std::micro>(stats.last_received - start).count());
+		}
+		bench = nullptr;
+		std::cout.imbue(std::locale("C"));
+		print_percentiles("get round trip", get_us, "us");
+		if (stats.has_output) {
+			print_percentiles("output_set_scale round trip", set_us, "us");
+		} else {
+			std::cout << "output_set_scale round trip: skipped, no outputs" << std::endl;
+		}
+		print_percentiles("update size", stats.sizes, "bytes");
+		print_percentiles("update decode (verify + walk)", stats.decode_us, "us");
+		if (stats.verify_failed) {
+			std::cout << "WARNING: some updates failed flatbuffer verification" << std::endl;
 		}
 	};
 
@@ -317,10 +538,22 @@ int main(int argc, char *argv[]) {
 		wldip_compositor_manager_subscribe(shooter, WLDIP_COMPOSITOR_MANAGER_TOPIC_SURFACES |
 		                                                WLDIP_COMPOSITOR_MANAGER_TOPIC_OUTPUTS |
 		                                                WLDIP_COMPOSITOR_MANAGER_TOPIC_INPUTDEVS);
-		while (true) {
-			wl_display_dispatch(display);
-			wl_display_roundtrip(display);
+		while (wl_display_dispatch(display) != -1) {
+		}
+	} else if (argc == 2 && std::string(argv[1]) == "repaint-stats") {
+		print_update = print_repaint_stats;
+		run_get();
+	} else if (argc == 2 && std::string(argv[1]) == "watch-repaint-stats") {
+		print_update = print_repaint_stats;
+		wldip_compositor_manager_subscribe(shooter, WLDIP_COMPOSITOR_MANAGER_TOPIC_OUTPUT_STATS);
+		while (wl_display_dispatch(display) != -1) {
 		}
+	} else if (argc == 2 && std::string(argv[1]) == "clients") {
+		print_update = print_clients;
+		run_get();
+	} else if ((argc == 2 || argc == 3) && std::string(argv[1]) == "bench" &&
+	           (argc == 2 || std::stoi(argv[2]) >= 1)) {
+		run_bench(argc == 3 ? std::stoi(argv[2]) : 1000);
 	} else if (argc == 4 && std::string(argv[1]) == "set-output-scale") {
 		wldip_compositor_manager_output_set_scale(shooter, std::stoi(argv[2]),
 		                                          wl_fixed_from_double(std::stod(argv[3])));
@@ -329,6 +562,40 @@ int main(int argc, char *argv[]) {
 		wldip_compositor_manager_device_set_natural_scrolling(shooter, std::stoi(argv[2]),
 		                                                      std::stoi(argv[3]), std::stoi(argv[4]));
 		run_get();
+	} else if (argc == 3 && std::string(argv[1]) == "find-app-id") {
+		run_query_surfaces(WLDIP_COMPOSITOR_MANAGER_SURFACE_FILTER_APP_ID, argv[2], 0);
+	} else if (argc == 3 && std::string(argv[1]) == "find-pid") {
+		run_query_surfaces(WLDIP_COMPOSITOR_MANAGER_SURFACE_FILTER_PID, nullptr, std::stoi(argv[2]));
+	} else if (argc == 3 && std::string(argv[1]) == "find-output") {
+		run_query_surfaces(WLDIP_COMPOSITOR_MANAGER_SURFACE_FILTER_OUTPUT, nullptr,
+		                   std::stoi(argv[2]));
+	} else if (argc == 4 && std::string(argv[1]) == "get-device") {
+		wldip_compositor_manager_query_input_device(shooter, 0, std::stoi(argv[2]),
+		                                            std::stoi(argv[3]));
+		wait_update(updates_recvd + 1);
+	} else if (argc == 3 && std::string(argv[1]) == "get-head") {
+		wldip_compositor_manager_query_head(shooter, 0, argv[2]);
+		wait_update(updates_recvd + 1);
+	} else if (argc > 2 && (argc - 2) % 6 == 0 && std::string(argv[1]) == "set-layout") {
+		for (int i = 2; i < argc; i += 6) {
+			wldip_compositor_manager_layout_output(
+			    shooter, argv[i], 1, std::stoi(argv[i + 1]), std::stoi(argv[i + 2]),
+			    std::stoi(argv[i + 3]), std::stoi(argv[i + 4]), 0,
+			    wl_fixed_from_double(std::stod(argv[i + 5])), WL_OUTPUT_TRANSFORM_NORMAL);
+		}
+		wldip_compositor_manager_layout_apply(shooter);
+		run_get();
+	} else if (argc == 3 && std::string(argv[1]) == "disable-output") {
+		wldip_compositor_manager_layout_output(shooter, argv[2], 0, 0, 0, 0, 0, 0,
+		                                       wl_fixed_from_int(1), WL_OUTPUT_TRANSFORM_NORMAL);
+		wldip_compositor_manager_layout_apply(shooter);
+		run_get();
+	} else if (argc == 2 && std::string(argv[1]) == "trace") {
+		wldip_compositor_manager_dump_trace(shooter);
+		wait_update(updates_recvd + 1);
+	} else if (argc == 3 && std::string(argv[1]) == "set-trace-level") {
+		wldip_compositor_manager_set_trace_level(shooter, std::stoi(argv[2]));
+		wl_display_roundtrip(display);
 	} else if (argc == 3 && std::string(argv[1]) == "activate-surface") {
 		wldip_compositor_manager_desktop_surface_activate(shooter, std::stoi(argv[2]));
 		run_get();
@@ -336,9 +603,22 @@ int main(int argc, char *argv[]) {
 		std::cerr << "Usage: " << argv[0] << " ..." << std::endl;
 		std::cerr << "  get" << std::endl;
 		std::cerr << "  watch" << std::endl;
+		std::cerr << "  repaint-stats" << std::endl;
+		std::cerr << "  clients" << std::endl;
+		std::cerr << "  bench [iterations >= 1]" << std::endl;
+		std::cerr << "  watch-repaint-stats" << std::endl;
 		std::cerr << "  set-output-scale id scale" << std::endl;
+		std::cerr << "  set-layout [name x y width height scale]..." << std::endl;
+		std::cerr << "  disable-output name" << std::endl;
 		std::cerr << "  set-natural-scroll seat_idx dev_idx 0/1" << std::endl;
 		std::cerr << "  activate-surface uid" << std::endl;
+		std::cerr << "  find-app-id app_id" << std::endl;
+		std::cerr << "  find-pid pid" << std::endl;
+		std::cerr << "  find-output id" << std::endl;
+		std::cerr << "  get-device seat_idx dev_idx" << std::endl;
+		std::cerr << "  get-head name" << std::endl;
+		std::cerr << "  trace" << std::endl;
+		std::cerr << "  set-trace-level 0-3" << std::endl;
 		return -1;
 	}
 }
@@ -0,0 +1,143 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <wayland-client.h>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include "wldip-capabilities-client-protocol.h"
+#include "wlr-layer-shell-unstable-v1-client-protocol.h"
+
+// Measures layer-shell commits per second, run it as the first client of a headless weston:
+//   weston --backend=headless-backend.so --modules=capabilities.so,layer-shell.so &
+//   layer-shell-bench [commits]
+
+static struct wldip_capabilities *caps;
+static struct zwlr_layer_shell_v1 *layer_shell;
+static struct wl_compositor *wl_comp;
+static struct wl_shm *shm;
+static uint32_t layer_shell_name, compositor_name, shm_name;
+
+static void handle_global(void *data, struct wl_registry *registry, uint32_t name,
+                          const char *interface, uint32_t version) {
+	// the first client to bind capabilities gets all of them, so bind it before everything else
+	if (strcmp(interface, "wldip_capabilities") == 0) {
+		caps = reinterpret_cast<struct wldip_capabilities *>(
+		    wl_registry_bind(registry, name, &wldip_capabilities_interface, 1));
+	} else if (strcmp(interface, "zwlr_layer_shell_v1") == 0) {
+		layer_shell_name = name;
+	} else if (strcmp(interface, "wl_compositor") == 0) {
+		compositor_name = name;
+	} else if (strcmp(interface, "wl_shm") == 0) {
+		shm_name = name;
+	}
+}
+
+static void handle_global_remove(void *data, struct wl_registry *registry, uint32_t name) {}
+
+static const struct wl_registry_listener registry_listener = {handle_global, handle_global_remove};
+
+static bool configured = false;
+
+static void on_configure(void *data, struct zwlr_layer_surface_v1 *surface, uint32_t serial,
+                         uint32_t width, uint32_t height) {
+	zwlr_layer_surface_v1_ack_configure(surface, serial);
+	configured = true;
+}
+
+static void on_closed(void *data, struct zwlr_layer_surface_v1 *surface) {
+	std::cerr << "layer surface closed" << std::endl;
+	exit(1);
+}
+
+static const struct zwlr_layer_surface_v1_listener layer_surface_listener = {on_configure,
+                                                                             on_closed};
+
+const int32_t bench_size = 64;
+const uint32_t bench_batch = 64;
+
+int main(int argc, char *argv[]) {
+	uint32_t commits = argc == 2 ? std::stoul(argv[1]) : 100000;
+	struct wl_display *display = wl_display_connect(nullptr);
+	if (display == nullptr) {
+		std::cerr << "failed to create display" << std::endl;
+		return -1;
+	}
+
+	struct wl_registry *registry = wl_display_get_registry(display);
+	wl_registry_add_listener(registry, &registry_listener, nullptr);
+	wl_display_roundtrip(display);
+	if (caps == nullptr || layer_shell_name == 0 || compositor_name == 0 || shm_name == 0) {
+		std::cerr << "failed to find capabilities, layer shell, compositor or shm interface"
+		          << std::endl;
+		return -1;
+	}
+	layer_shell = reinterpret_cast<struct zwlr_layer_shell_v1 *>(
+	    wl_registry_bind(registry, layer_shell_name, &zwlr_layer_shell_v1_interface, 1));
+	wl_comp = reinterpret_cast<struct wl_compositor *>(
+	    wl_registry_bind(registry, compositor_name, &wl_compositor_interface, 1));
+	shm = reinterpret_cast<struct wl_shm *>(
+	    wl_registry_bind(registry, shm_name, &wl_shm_interface, 1));
+
+	int32_t stride = bench_size * 4;
+	int fd = shm_open(SHM_ANON, O_RDWR, 0600);
+	if (fd < 0 || ftruncate(fd, stride * bench_size) < 0) {
+		std::cerr << "failed to allocate buffer" << std::endl;
+		return -1;
+	}
+	struct wl_shm_pool *pool = wl_shm_create_pool(shm, fd, stride * bench_size);
+	struct wl_buffer *buffer = wl_shm_pool_create_buffer(pool, 0, bench_size, bench_size, stride,
+	                                                     WL_SHM_FORMAT_ARGB8888);
+	close(fd);
+
+	struct wl_surface *surface = wl_compositor_create_surface(wl_comp);
+	auto *layer_surface = zwlr_layer_shell_v1_get_layer_surface(
+	    layer_shell, surface, nullptr, ZWLR_LAYER_SHELL_V1_LAYER_TOP, "layer-shell-bench");
+	zwlr_layer_surface_v1_add_listener(layer_surface, &layer_surface_listener, nullptr);
+	zwlr_layer_surface_v1_set_size(layer_surface, bench_size, bench_size);
+	zwlr_layer_surface_v1_set_anchor(layer_surface, ZWLR_LAYER_SURFACE_V1_ANCHOR_TOP);
+	wl_surface_commit(surface);
+	while (!configured) {
+		if (wl_display_dispatch(display) < 0) {
+			std::cerr << "connection lost before configure" << std::endl;
+			return -1;
+		}
+	}
+	wl_surface_attach(surface, buffer, 0, 0);
+	wl_surface_damage(surface, 0, 0, bench_size, bench_size);
+	wl_surface_commit(surface);
+	wl_display_roundtrip(display);
+
+	// contents: what an animated panel does. margin: every commit also changes geometry
+	auto run = [&](const char *name, bool relayout) {
+		auto start = std::chrono::steady_clock::now();
+		for (uint32_t i = 0; i < commits; i++) {
+			if (relayout) {
+				zwlr_layer_surface_v1_set_margin(layer_surface, i % 2, 0, 0, 0);
+			}
+			wl_surface_attach(surface, buffer, 0, 0);
+			wl_surface_damage(surface, i % bench_size, 0, 1, 1);
+			wl_surface_commit(surface);
+			if (i % bench_batch == bench_batch - 1) {
+				wl_display_roundtrip(display);
+			}
+		}
+		wl_display_roundtrip(display);
+		double secs =
+		    std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		std::cout << name << ": " << commits << " commits in " << secs << " s, "
+		          << static_cast<uint64_t>(commits / secs) << " commits/sec" << std::endl;
+	};
+	std::cout.imbue(std::locale("C"));
+	run("contents", false);
+	run("margin", true);
+
+	zwlr_layer_surface_v1_destroy(layer_surface);
+	wl_surface_destroy(surface);
+	wl_buffer_destroy(buffer);
+	wl_shm_pool_destroy(pool);
+	wl_display_roundtrip(display);
+	wl_display_disconnect(display);
+}
@@ -1,28 +1,80 @@
+#include <algorithm>
 #include <iostream>
+#include <string>
 #include <tuple>
 #include <unordered_map>
 #include <utility>
+#include "weston-extra-dip-trace.h"
 
 extern "C" {
 #include <compositor.h>
+#include <config-parser.h>
 #include <desktop-shell-api.h>
 #include <linux/input.h>
 #include <unistd.h>
+#include <weston.h>
 #include "weston-extra-dip-capabilities-api.h"
+#include "weston-extra-dip-layer-shell-api.h"
 #include "wlr-layer-shell-unstable-v1-server-protocol.h"
 
 static struct weston_compositor *compositor = nullptr;
 static const struct weston_desktop_shell_api *desk_shell = nullptr;
-static const struct weston_extra_dip_capabilities_api *caps = nullptr;
-
-struct lsh_context;
-static std::unordered_map<struct weston_view *, struct lsh_context *> lsh_views;
+static const struct weston_extra_dip_capabilities_api_v2 *caps = nullptr;
+static int32_t cap_layer_shell = -1;
+static int32_t cap_layer_shell_overlay = -1;
+static extra_dip_trace_ring trace("layer-shell");
+// Emitted with the output when its work area changes, see weston-extra-dip-layer-shell-api.h.
+// Nothing in this tree listens, desktop-shell needs an out-of-tree change to subscribe
+static struct wl_signal work_area_changed_signal;
 
 struct weston_layer lr_background = {nullptr};
 struct weston_layer lr_bottom = {nullptr};
 struct weston_layer lr_top = {nullptr};
 struct weston_layer lr_overlay = {nullptr};
 
+// Mapped keyboard-interactive surfaces (lsh_context::focus_link), topmost first
+static struct wl_list focus_stack_top;
+static struct wl_list focus_stack_overlay;
+
+// Background and bottom surfaces covered by opaque views (lsh_context::occluded_link). Their frame
+// callbacks are held back and released occluded_fps times per second, or not at all for 0
+static struct wl_list occluded_surfaces;
+static struct wl_event_source *occluded_timer = nullptr;
+static uint32_t occluded_fps = 1;
+
+// Frame rate caps from [layer-shell-frame-rate] sections of weston.ini, by namespace. Capped
+// surfaces waiting for their next frame are in paced_surfaces (lsh_context::paced_link)
+static std::unordered_map<std::string, uint32_t> namespace_fps;
+static struct wl_list paced_surfaces;
+static struct wl_event_source *pacing_timer = nullptr;
+
+#define NSEC_PER_SEC 1000000000
+
+static int64_t now_nsec() {
+	struct timespec now {};
+	weston_compositor_read_presentation_clock(compositor, &now);
+	return static_cast<int64_t>(now.tv_sec) * NSEC_PER_SEC + now.tv_nsec;
+}
+
+// What happens to surfaces bound to an output when it goes away, from output-gone in the
+// [layer-shell] section of weston.ini. Migrated and parked surfaces are in homeless_surfaces
+// (lsh_context::homeless_link) until an output with the same head name or serial number shows up
+enum lsh_output_gone_policy {
+	LSH_OUTPUT_GONE_CLOSE,    // close
+	LSH_OUTPUT_GONE_MIGRATE,  // migrate: move to the focused output meanwhile
+	LSH_OUTPUT_GONE_PARK,     // park: unmap meanwhile
+};
+static lsh_output_gone_policy output_gone_policy = LSH_OUTPUT_GONE_CLOSE;
+static struct wl_list homeless_surfaces;
+
+// Surfaces to lay out again without a commit (lsh_context::relayout_link)
+static struct wl_list relayout_surfaces;
+static struct wl_event_source *relayout_idle = nullptr;
+
+// Surfaces shown on every output (lsh_context::mirror_link)
+static struct wl_list mirror_surfaces;
+const char lsh_mirror_prefix[] = "mirror:";
+
 static void committed_callback(struct weston_surface *surface, int32_t sx, int32_t sy);
 
 static void set_size(struct wl_client *client, struct wl_resource *resource, uint32_t width,
@@ -45,8 +97,9 @@ static struct zwlr_layer_surface_v1_interface lsh_impl = {
 
 static void lsh_destructor(struct wl_resource *resource);
 
-static void on_output_gone(struct wl_listener *listener, void *data);
 static void on_surface_gone(struct wl_listener *listener, void *data);
+static void on_output_gone(struct wl_listener *listener, void *data);
+static void on_output_frame(struct wl_listener *listener, void *data);
 
 const auto t = ZWLR_LAYER_SURFACE_V1_ANCHOR_TOP;
 const auto r = ZWLR_LAYER_SURFACE_V1_ANCHOR_RIGHT;
@@ -57,6 +110,121 @@ using coords = std::pair<int32_t, int32_t>;
 
 struct lsh_margin {
 	int32_t top, right, bottom, left;
+
+	bool operator==(const lsh_margin &o) const {
+		return top == o.top && right == o.right && bottom == o.bottom && left == o.left;
+	}
+};
+
+// State changed since the last relayout. Commits with nothing dirty and the same output and
+// surface size only change buffer contents, weston already applies their damage
+enum lsh_dirty : uint32_t {
+	LSH_DIRTY_ANCHOR = 1 << 0,
+	LSH_DIRTY_MARGIN = 1 << 1,
+	LSH_DIRTY_SIZE = 1 << 2,
+	LSH_DIRTY_EXCLUSIVE_ZONE = 1 << 3,
+	LSH_DIRTY_OUTPUT = 1 << 4,
+	LSH_DIRTY_KEYBOARD = 1 << 5,
+	LSH_DIRTY_CONFIGURE_ACKED = 1 << 6,
+	LSH_DIRTY_ALL = (1 << 7) - 1,
+};
+
+// Inputs of the last relayout
+struct lsh_layout {
+	struct weston_output *output = nullptr;
+	int32_t output_x = 0, output_y = 0, output_width = 0, output_height = 0;
+	coords surface_size{0, 0};
+
+	bool matches(struct weston_output *o, coords size) const {
+		return o == output && o->x == output_x && o->y == output_y && o->width == output_width &&
+		       o->height == output_height && size == surface_size;
+	}
+};
+
+// The layer surfaces placed on one output, and its work area: the exclusive zones of the mapped
+// surfaces summed per edge. Found through the output's destroy listener
+struct lsh_output {
+	struct weston_output *output;
+	// lsh_context::output_link per zwlr_layer_shell_v1_layer, topmost first
+	struct wl_list layers[ZWLR_LAYER_SHELL_V1_LAYER_OVERLAY + 1];
+	int32_t top = 0, right = 0, bottom = 0, left = 0;
+	struct wl_listener output_destroy_listener {
+		.notify = on_output_gone
+	};
+	struct wl_listener frame_listener {
+		.notify = on_output_frame
+	};
+
+	explicit lsh_output(struct weston_output *o) : output(o) {
+		for (auto &layer : layers) {
+			wl_list_init(&layer);
+		}
+		wl_signal_add(&output->destroy_signal, &output_destroy_listener);
+		wl_signal_add(&output->frame_signal, &frame_listener);
+	}
+
+	int32_t &edge(uint32_t anchor) {
+		return anchor == t ? top : anchor == r ? right : anchor == b ? bottom : left;
+	}
+
+	lsh_output(lsh_output &&) = delete;
+};
+
+static struct lsh_output *lsh_output_get(struct weston_output *output, bool create) {
+	struct wl_listener *listener = wl_signal_get(&output->destroy_signal, on_output_gone);
+	if (listener != nullptr) {
+		return wl_container_of(listener, static_cast<struct lsh_output *>(nullptr),
+		                       output_destroy_listener);
+	}
+	return create ? new lsh_output(output) : nullptr;
+}
+
+static void work_area_changed(struct lsh_output *lo) {
+	EXTRA_DIP_TRACE(trace, EXTRA_DIP_TRACE_INFO, "work area changed", lo->top, lo->right,
+	                lo->bottom, lo->left);
+	wl_signal_emit(&work_area_changed_signal, lo->output);
+}
+
+// The contribution of one surface (or mirror) to a work area
+struct lsh_zone {
+	struct weston_output *output = nullptr;
+	uint32_t edge = 0;
+	int32_t size = 0;
+};
+
+// Moves a contribution to the work area it belongs to now, if any
+static void move_zone(struct lsh_zone &zone, struct lsh_zone next) {
+	if (next.output == zone.output && next.edge == zone.edge && next.size == zone.size) {
+		return;
+	}
+	struct lsh_zone prev = zone;
+	zone = next;
+	struct lsh_output *prev_lo = nullptr, *next_lo = nullptr;
+	if (prev.output != nullptr) {
+		prev_lo = lsh_output_get(prev.output, true);
+		prev_lo->edge(prev.edge) -= prev.size;
+	}
+	if (next.output != nullptr) {
+		next_lo = lsh_output_get(next.output, true);
+		next_lo->edge(next.edge) += next.size;
+	}
+	if (prev_lo != nullptr) {
+		work_area_changed(prev_lo);
+	}
+	if (next_lo != nullptr && next_lo != prev_lo) {
+		work_area_changed(next_lo);
+	}
+}
+
+// A view of a mirrored surface on an output other than the one it's laid out on, scaled like a
+// separate surface on that output would have been configured. It reserves the surface's exclusive
+// zone on its output, scaled the same way
+struct lsh_mirror {
+	struct weston_view *view;
+	struct weston_output *output;
+	struct weston_transform scale;
+	struct lsh_zone zone;
+	struct wl_list link;  // lsh_context::mirrors
 };
 
 struct lsh_context {
@@ -65,29 +233,72 @@ struct lsh_context {
 	struct weston_head *head;
 	zwlr_layer_shell_v1_layer layer;
 	zwlr_layer_surface_v1_anchor anchor = t;
-	coords req_size;
+	coords req_size{0, 0};
 	int32_t excl_zone = 0;
 	struct lsh_margin margin = {0, 0, 0, 0};
 	struct wl_resource *resource;
-	struct wl_listener output_destroy_listener {
-		.notify = on_output_gone
-	};
+	// in lsh_output::layers of the output it's placed on, or empty
+	struct wl_list output_link;
+	// in the focus stack of its layer, or empty
+	struct wl_list focus_link;
+	// in mirror_surfaces if the surface is mirrored, or empty
+	struct wl_list mirror_link;
+	struct wl_list mirrors;
+	// in occluded_surfaces, or empty
+	struct wl_list occluded_link;
+	// frame callbacks (wl_resource links) held back while occluded, paced or parked
+	struct wl_list held_frames;
+	std::string ns;
+	uint32_t max_fps = 0;
+	int64_t next_frame_nsec = 0;
+	// in paced_surfaces while frame callbacks wait for the frame rate cap, or empty
+	struct wl_list paced_link;
+	// the head the surface was bound to while it's in homeless_surfaces
+	std::string home_name, home_serial;
+	struct wl_list homeless_link;
+	bool parked = false;
+	struct wl_list relayout_link;
 	struct wl_listener surface_destroy_listener {
 		.notify = on_surface_gone
 	};
 	bool keyboard_interactive = false;
 	bool destroyed = false;
+	uint32_t dirty = LSH_DIRTY_ALL;
+	struct lsh_layout laid_out;
+	struct lsh_zone zone;
+	// the last configure sent, pending until the client acks it
+	uint32_t configure_serial = 0;
+	coords configure_size{0, 0};
+	bool configure_pending = false;
 
 	lsh_context(struct weston_surface *s, struct weston_head *h, zwlr_layer_shell_v1_layer l,
-	            struct wl_client *client, uint32_t id)
-	    : surface(s), head(h), layer(l) {
+	            const char *n, bool mirror, struct wl_client *client, uint32_t id)
+	    : surface(s), head(h), layer(l), ns(n) {
+		wl_list_init(&output_link);
+		wl_list_init(&focus_link);
+		wl_list_init(&mirrors);
+		wl_list_init(&occluded_link);
+		wl_list_init(&held_frames);
+		wl_list_init(&paced_link);
+		wl_list_init(&homeless_link);
+		wl_list_init(&relayout_link);
+		auto fps = namespace_fps.find(ns);
+		if (fps != namespace_fps.end()) {
+			max_fps = fps->second;
+		}
+		if (mirror) {
+			wl_list_insert(&mirror_surfaces, &mirror_link);
+		} else {
+			wl_list_init(&mirror_link);
+		}
 		if (head != nullptr) {
-			wl_signal_add(&weston_head_get_output(head)->destroy_signal, &output_destroy_listener);
-			weston_log("layer-shell: attached to output %p\n", weston_head_get_output(head));
+			// placed right away, so that it gets closed if the output goes away before the first commit
+			place(weston_head_get_output(head));
+			EXTRA_DIP_TRACE(trace, EXTRA_DIP_TRACE_INFO, "attached to output",
+			                reinterpret_cast<intptr_t>(weston_head_get_output(head)));
 		}
 		wl_signal_add(&surface->destroy_signal, &surface_destroy_listener);
 		view = weston_view_create(surface);
-		lsh_views.emplace(view, this);
 		surface->committed_private = this;
 		surface->committed = committed_callback;
 		resource = wl_resource_create(client, &zwlr_layer_surface_v1_interface, 1, id);
@@ -95,7 +306,7 @@ struct lsh_context {
 		if (!weston_view_is_mapped(view)) {
 			// the client could commit everything before this constructor ends,
 			// so the committed callback wouldn't be called. force a reconfig here
-			zwlr_layer_surface_v1_send_configure(resource, 0, 1, 1);
+			configure(std::make_pair(1, 1));
 		}
 	}
 
@@ -122,6 +333,206 @@ struct lsh_context {
 		return std::make_pair(x, y);
 	}
 
+	// Puts the surface on top of its layer on the output
+	void place(struct weston_output *output) {
+		set_occluded(false);
+		wl_list_remove(&output_link);
+		if (output == nullptr) {
+			wl_list_init(&output_link);
+			return;
+		}
+		wl_list_insert(&lsh_output_get(output, true)->layers[layer], &output_link);
+	}
+
+	bool is_mirrored() const { return !wl_list_empty(&mirror_link); }
+
+	void release_frames() {
+		struct timespec now {};
+		weston_compositor_read_presentation_clock(surface->compositor, &now);
+		auto msec = static_cast<uint32_t>(now.tv_sec * 1000 + now.tv_nsec / 1000000);
+		struct wl_resource *cb, *tmp;
+		wl_resource_for_each_safe(cb, tmp, &held_frames) {
+			wl_callback_send_done(cb, msec);
+			wl_resource_destroy(cb);
+		}
+	}
+
+	// Lets the pending frame callbacks through if the last frame was long enough ago, or holds them
+	// for the pacing timer
+	void pace_frames() {
+		int64_t now = now_nsec();
+		if (wl_list_empty(&held_frames) && now >= next_frame_nsec) {
+			next_frame_nsec = now + NSEC_PER_SEC / max_fps;
+			return;
+		}
+		wl_list_insert_list(&held_frames, &surface->pending.frame_callback_list);
+		wl_list_init(&surface->pending.frame_callback_list);
+		if (wl_list_empty(&paced_link)) {
+			wl_list_insert(&paced_surfaces, &paced_link);
+			arm_pacing_timer(now);
+		}
+	}
+
+	static void arm_pacing_timer(int64_t now) {
+		int64_t next = INT64_MAX;
+		struct lsh_context *ctx;
+		wl_list_for_each(ctx, &paced_surfaces, paced_link) {
+			next = std::min(next, ctx->next_frame_nsec);
+		}
+		if (next != INT64_MAX) {
+			int64_t msec = (next - now + 999999) / 1000000;
+			wl_event_source_timer_update(pacing_timer, static_cast<int>(std::max<int64_t>(msec, 1)));
+		}
+	}
+
+	void set_occluded(bool occluded) {
+		if (occluded == !wl_list_empty(&occluded_link)) {
+			return;
+		}
+		EXTRA_DIP_TRACE(trace, EXTRA_DIP_TRACE_DEBUG, "occluded", reinterpret_cast<intptr_t>(surface),
+		                static_cast<int>(occluded));
+		if (!occluded) {
+			wl_list_remove(&occluded_link);
+			wl_list_init(&occluded_link);
+			release_frames();
+			return;
+		}
+		if (wl_list_empty(&occluded_surfaces) && occluded_fps > 0) {
+			wl_event_source_timer_update(occluded_timer, 1000 / occluded_fps);
+		}
+		wl_list_insert(&occluded_surfaces, &occluded_link);
+	}
+
+	void destroy_mirror(struct lsh_mirror *m) {
+		EXTRA_DIP_TRACE(trace, EXTRA_DIP_TRACE_INFO, "removing mirror",
+		                reinterpret_cast<intptr_t>(surface), reinterpret_cast<intptr_t>(m->output));
+		move_zone(m->zone, lsh_zone{});
+		wl_list_remove(&m->link);
+		wl_list_remove(&m->scale.link);
+		weston_view_damage_below(m->view);
+		weston_view_destroy(m->view);
+		delete m;
+	}
+
+	void layout_mirror(struct lsh_mirror *m) {
+		auto surface_size = std::make_pair(surface->width, surface->height);
+		auto output_size = std::make_pair(m->output->width, m->output->height);
+		auto size = next_size(surface_size, output_size);
+		float sx = surface->width > 0 ? static_cast<float>(size.first) / surface->width : 1;
+		float sy = surface->height > 0 ? static_cast<float>(size.second) / surface->height : 1;
+		weston_matrix_init(&m->scale.matrix);
+		weston_matrix_scale(&m->scale.matrix, sx, sy, 1);
+		int32_t x, y;
+		std::tie(x, y) = position(size, output_size);
+		weston_view_set_position(m->view, x + m->output->x, y + m->output->y);
+		weston_view_geometry_dirty(m->view);
+		weston_view_update_transform(m->view);
+		update_mirror_zone(m);
+	}
+
+	// Follows the surface's own zone, so it has to be called after update_zone
+	void update_mirror_zone(struct lsh_mirror *m) {
+		struct lsh_zone next;
+		if (zone.output != nullptr) {
+			auto size = next_size(std::make_pair(surface->width, surface->height),
+			                      std::make_pair(m->output->width, m->output->height));
+			bool vertical = zone.edge == t || zone.edge == b;
+			int32_t from = vertical ? surface->height : surface->width;
+			int32_t to = vertical ? size.second : size.first;
+			next = {m->output, zone.edge, from > 0 ? excl_zone * to / from : excl_zone};
+		}
+		move_zone(m->zone, next);
+	}
+
+	// Gives every output except the laid out one a mirror view below the main one, lays them out
+	void sync_mirrors() {
+		struct lsh_mirror *m, *tmp;
+		wl_list_for_each_safe(m, tmp, &mirrors, link) {
+			if (m->output == laid_out.output) {
+				destroy_mirror(m);
+			}
+		}
+		struct weston_output *output;
+		wl_list_for_each(output, &surface->compositor->output_list, link) {
+			if (output == laid_out.output) {
+				continue;
+			}
+			bool found = false;
+			wl_list_for_each(m, &mirrors, link) { found = found || m->output == output; }
+			if (found) {
+				continue;
+			}
+			EXTRA_DIP_TRACE(trace, EXTRA_DIP_TRACE_INFO, "adding mirror",
+			                reinterpret_cast<intptr_t>(surface), reinterpret_cast<intptr_t>(output));
+			m = new lsh_mirror;
+			m->view = weston_view_create(surface);
+			m->output = output;
+			// before the position, so that the scale applies to surface coordinates
+			wl_list_insert(&m->view->geometry.transformation_list, &m->scale.link);
+			weston_layer_entry_insert(&view->layer_link, &m->view->layer_link);
+			m->view->is_mapped = true;
+			wl_list_insert(&mirrors, &m->link);
+		}
+		wl_list_for_each(m, &mirrors, link) { layout_mirror(m); }
+	}
+
+	// Puts the surface on top of its layer's focus stack if it's mapped and keyboard-interactive,
+	// or takes it out
+	void update_focus_stack(bool mapped) {
+		wl_list_remove(&focus_link);
+		wl_list_init(&focus_link);
+		if (!mapped || !keyboard_interactive) {
+			return;
+		}
+		if (layer == ZWLR_LAYER_SHELL_V1_LAYER_OVERLAY) {
+			wl_list_insert(&focus_stack_overlay, &focus_link);
+		} else if (layer == ZWLR_LAYER_SHELL_V1_LAYER_TOP) {
+			wl_list_insert(&focus_stack_top, &focus_link);
+		}
+	}
+
+	// The edge the exclusive zone applies to: the surface has to be anchored to that edge alone or
+	// to it and both perpendicular edges
+	uint32_t exclusive_edge() const {
+		for (uint32_t edge : {t, r, b, l}) {
+			uint32_t perpendicular = (edge == t || edge == b) ? (l | r) : (t | b);
+			if (anchor == edge || anchor == (edge | perpendicular)) {
+				return edge;
+			}
+		}
+		return 0;
+	}
+
+	// Moves this surface's exclusive zone, and its mirrors', to the work areas they currently
+	// belong to, if any
+	void update_zone(bool mapped) {
+		struct lsh_zone next;
+		if (mapped && excl_zone > 0 && exclusive_edge() != 0) {
+			next = {laid_out.output, exclusive_edge(), excl_zone};
+		}
+		move_zone(zone, next);
+		struct lsh_mirror *m;
+		wl_list_for_each(m, &mirrors, link) { update_mirror_zone(m); }
+	}
+
+	// The size the surface will have once the client catches up
+	coords expected_size(coords surface_size) const {
+		return configure_pending ? configure_size : surface_size;
+	}
+
+	// Sends a configure unless the client already has one for this size
+	void configure(coords size) {
+		if (configure_pending && size == configure_size) {
+			return;
+		}
+		configure_serial = wl_display_next_serial(surface->compositor->wl_display);
+		configure_size = size;
+		configure_pending = true;
+		EXTRA_DIP_TRACE(trace, EXTRA_DIP_TRACE_DEBUG, "sending configure", configure_serial, size.first,
+		                size.second);
+		zwlr_layer_surface_v1_send_configure(resource, configure_serial, size.first, size.second);
+	}
+
 	coords next_size(coords old_size, coords output_size) {
 		int32_t w, h, ow, oh, rw, rh;
 		std::tie(w, h) = old_size;
@@ -148,16 +559,24 @@ struct lsh_context {
 			return;
 		}
 		destroyed = true;
-		weston_log("layer-shell: destroying surface\n");
-		if (head != nullptr && output_destroy_listener.link.prev != nullptr) {
-			wl_list_remove(&output_destroy_listener.link);
-		}
+		EXTRA_DIP_TRACE(trace, EXTRA_DIP_TRACE_INFO, "destroying surface",
+		                reinterpret_cast<intptr_t>(surface));
+		wl_list_remove(&output_link);
+		wl_list_remove(&focus_link);
+		wl_list_remove(&mirror_link);
+		set_occluded(false);
+		wl_list_remove(&paced_link);
+		release_frames();
+		wl_list_remove(&homeless_link);
+		wl_list_remove(&relayout_link);
+		struct lsh_mirror *m, *tmp;
+		wl_list_for_each_safe(m, tmp, &mirrors, link) { destroy_mirror(m); }
 		if (surface_destroy_listener.link.prev != nullptr) {
 			wl_list_remove(&surface_destroy_listener.link);
 		}
+		update_zone(false);
 		weston_view_damage_below(view);
 		weston_view_destroy(view);
-		lsh_views.erase(view);
 		weston_surface_unmap(surface);
 		weston_compositor_schedule_repaint(surface->compositor);
 		surface->committed = nullptr;
@@ -168,25 +587,233 @@ struct lsh_context {
 	lsh_context(lsh_context &&) = delete;
 };
 
-static void on_output_gone(struct wl_listener *listener, void *data) {
-	auto *ctx = wl_container_of(listener, static_cast<struct lsh_context *>(nullptr),
-	                            output_destroy_listener);
-	weston_log("layer-shell: output gone, sending close to surface\n");
-	zwlr_layer_surface_v1_send_closed(ctx->resource);
-}
-
 static void on_surface_gone(struct wl_listener *listener, void *data) {
 	auto *ctx = wl_container_of(listener, static_cast<struct lsh_context *>(nullptr),
 	                            surface_destroy_listener);
-	weston_log("layer-shell: surface gone, destroying layer surface\n");
+	EXTRA_DIP_TRACE(trace, EXTRA_DIP_TRACE_INFO, "surface gone",
+	                reinterpret_cast<intptr_t>(ctx->surface));
 	delete ctx;
 	// will set resource user_data to nullptr
 }
 
+static void on_relayout_idle(void *data) {
+	relayout_idle = nullptr;
+	struct lsh_context *ctx, *tmp;
+	wl_list_for_each_safe(ctx, tmp, &relayout_surfaces, relayout_link) {
+		wl_list_remove(&ctx->relayout_link);
+		wl_list_init(&ctx->relayout_link);
+		ctx->dirty |= LSH_DIRTY_OUTPUT;
+		committed_callback(ctx->surface, 0, 0);
+	}
+	weston_compositor_schedule_repaint(compositor);
+}
+
+static void schedule_relayout(struct lsh_context *ctx) {
+	if (wl_list_empty(&ctx->relayout_link)) {
+		wl_list_insert(relayout_surfaces.prev, &ctx->relayout_link);
+	}
+	if (relayout_idle == nullptr) {
+		relayout_idle = wl_event_loop_add_idle(wl_display_get_event_loop(compositor->wl_display),
+		                                       on_relayout_idle, nullptr);
+	}
+}
+
+// Unbinds the surface from its head, which is going away with its output, and remembers the head
+static void leave_home(struct lsh_context *ctx) {
+	ctx->home_name = weston_head_get_name(ctx->head);
+	ctx->home_serial = ctx->head->serial_number != nullptr ? ctx->head->serial_number : "";
+	ctx->head = nullptr;
+	wl_list_insert(&homeless_surfaces, &ctx->homeless_link);
+	if (output_gone_policy == LSH_OUTPUT_GONE_MIGRATE) {
+		EXTRA_DIP_TRACE(trace, EXTRA_DIP_TRACE_INFO, "output gone, migrating",
+		                reinterpret_cast<intptr_t>(ctx->surface));
+		schedule_relayout(ctx);
+		return;
+	}
+	EXTRA_DIP_TRACE(trace, EXTRA_DIP_TRACE_INFO, "output gone, parking",
+	                reinterpret_cast<intptr_t>(ctx->surface));
+	ctx->parked = true;
+	ctx->update_focus_stack(false);
+	// drops the seats' focus and the output too, the next commit after return_home maps it again
+	weston_surface_unmap(ctx->surface);
+	// paced and occluded callbacks go out now, later ones are held until the output is back
+	ctx->set_occluded(false);
+	wl_list_remove(&ctx->paced_link);
+	wl_list_init(&ctx->paced_link);
+	ctx->release_frames();
+}
+
+static bool head_matches(struct weston_head *head, const struct lsh_context *ctx) {
+	return ctx->home_name == weston_head_get_name(head) ||
+	       (!ctx->home_serial.empty() && head->serial_number != nullptr &&
+	        ctx->home_serial == head->serial_number);
+}
+
+// Binds surfaces waiting for their head back to it, they get a configure if the size changes
+static void return_home(struct weston_output *output) {
+	struct lsh_context *ctx, *tmp;
+	wl_list_for_each_safe(ctx, tmp, &homeless_surfaces, homeless_link) {
+		struct weston_head *head = nullptr;
+		while ((head = weston_output_iterate_heads(output, head)) != nullptr) {
+			if (head_matches(head, ctx)) {
+				break;
+			}
+		}
+		if (head == nullptr) {
+			continue;
+		}
+		EXTRA_DIP_TRACE(trace, EXTRA_DIP_TRACE_INFO, "output back, returning",
+		                reinterpret_cast<intptr_t>(ctx->surface), reinterpret_cast<intptr_t>(output));
+		wl_list_remove(&ctx->homeless_link);
+		wl_list_init(&ctx->homeless_link);
+		ctx->head = head;
+		ctx->parked = false;
+		ctx->release_frames();
+		ctx->place(output);
+		schedule_relayout(ctx);
+	}
+}
+
+static void on_output_gone(struct wl_listener *listener, void *data) {
+	auto *lo =
+	    wl_container_of(listener, static_cast<struct lsh_output *>(nullptr), output_destroy_listener);
+	wl_list_remove(&lo->output_destroy_listener.link);
+	wl_list_remove(&lo->frame_listener.link);
+	for (auto &layer : lo->layers) {
+		struct lsh_context *ctx, *tmp;
+		wl_list_for_each_safe(ctx, tmp, &layer, output_link) {
+			ctx->set_occluded(false);
+			wl_list_remove(&ctx->output_link);
+			wl_list_init(&ctx->output_link);
+			ctx->zone = lsh_zone{};
+			ctx->dirty |= LSH_DIRTY_OUTPUT;
+			ctx->laid_out.output = nullptr;
+			if (ctx->head != nullptr && output_gone_policy != LSH_OUTPUT_GONE_CLOSE) {
+				leave_home(ctx);
+			} else if (ctx->head != nullptr) {
+				EXTRA_DIP_TRACE(trace, EXTRA_DIP_TRACE_INFO, "output gone, sending close",
+				                reinterpret_cast<intptr_t>(ctx->surface));
+				zwlr_layer_surface_v1_send_closed(ctx->resource);
+			}
+		}
+	}
+	// mirror views on this output are destroyed by on_output_destroyed, don't rely on the order
+	struct lsh_context *ctx;
+	wl_list_for_each(ctx, &mirror_surfaces, mirror_link) {
+		struct lsh_mirror *m;
+		wl_list_for_each(m, &ctx->mirrors, link) {
+			if (m->zone.output == lo->output) {
+				m->zone = lsh_zone{};
+			}
+		}
+	}
+	delete lo;
+}
+
+// view->clip is what the views above cover, as of the repaint that just happened
+static bool view_occluded(struct weston_view *view) {
+	pixman_box32_t *box = pixman_region32_extents(&view->transform.boundingbox);
+	return box->x2 > box->x1 && box->y2 > box->y1 &&
+	       pixman_region32_contains_rectangle(&view->clip, box) == PIXMAN_REGION_IN;
+}
+
+static void on_output_frame(struct wl_listener *listener, void *data) {
+	auto *lo = wl_container_of(listener, static_cast<struct lsh_output *>(nullptr), frame_listener);
+	for (auto layer : {ZWLR_LAYER_SHELL_V1_LAYER_BACKGROUND, ZWLR_LAYER_SHELL_V1_LAYER_BOTTOM}) {
+		struct lsh_context *ctx;
+		wl_list_for_each(ctx, &lo->layers[layer], output_link) {
+			// a mirrored surface can be covered here and visible on another output
+			if (weston_view_is_mapped(ctx->view) && !ctx->is_mirrored()) {
+				ctx->set_occluded(view_occluded(ctx->view));
+			}
+		}
+	}
+}
+
+// Interval between repaints of the output, callbacks due before the next repaint go out together
+static int64_t repaint_nsec(struct weston_output *output) {
+	if (output == nullptr || output->current_mode == nullptr || output->current_mode->refresh <= 0) {
+		return 0;
+	}
+	return static_cast<int64_t>(1000) * NSEC_PER_SEC / output->current_mode->refresh;
+}
+
+static int on_pacing_timer(void *data) {
+	int64_t now = now_nsec();
+	struct lsh_context *ctx, *tmp;
+	wl_list_for_each_safe(ctx, tmp, &paced_surfaces, paced_link) {
+		if (ctx->next_frame_nsec <= now + repaint_nsec(ctx->laid_out.output)) {
+			ctx->release_frames();
+			ctx->next_frame_nsec = now + NSEC_PER_SEC / ctx->max_fps;
+			wl_list_remove(&ctx->paced_link);
+			wl_list_init(&ctx->paced_link);
+		}
+	}
+	lsh_context::arm_pacing_timer(now);
+	return 0;
+}
+
+static int on_occluded_timer(void *data) {
+	struct lsh_context *ctx;
+	wl_list_for_each(ctx, &occluded_surfaces, occluded_link) { ctx->release_frames(); }
+	if (!wl_list_empty(&occluded_surfaces)) {
+		wl_event_source_timer_update(occluded_timer, 1000 / occluded_fps);
+	}
+	return 0;
+}
+
+// The seat with a keyboard whose pointer is on the output, or else the first one with a keyboard
+static struct weston_seat *seat_for_output(struct weston_output *output) {
+	struct weston_seat *seat, *fallback = nullptr;
+	wl_list_for_each(seat, &output->compositor->seat_list, link) {
+		if (weston_seat_get_keyboard(seat) == nullptr) {
+			continue;
+		}
+		struct weston_pointer *pointer = weston_seat_get_pointer(seat);
+		if (pointer != nullptr &&
+		    pixman_region32_contains_point(&output->region, wl_fixed_to_int(pointer->x),
+		                                   wl_fixed_to_int(pointer->y), nullptr)) {
+			return seat;
+		}
+		if (fallback == nullptr) {
+			fallback = seat;
+		}
+	}
+	return fallback;
+}
+
 static void committed_callback(struct weston_surface *surface, int32_t sx, int32_t sy) {
 	auto *ctx = static_cast<struct lsh_context *>(surface->committed_private);
-	weston_log("layer-shell: is_mapped: %d\n", static_cast<int>(weston_view_is_mapped(ctx->view)));
-	if (!weston_view_is_mapped(ctx->view)) {
+	if (ctx->parked) {
+		// stays unmapped until its output is back, nothing would send the callbacks
+		wl_list_insert_list(&ctx->held_frames, &surface->pending.frame_callback_list);
+		wl_list_init(&surface->pending.frame_callback_list);
+		return;
+	}
+	bool was_mapped = weston_view_is_mapped(ctx->view);
+	EXTRA_DIP_TRACE(trace, EXTRA_DIP_TRACE_DEBUG, "commit", reinterpret_cast<intptr_t>(surface),
+	                static_cast<int>(was_mapped), ctx->dirty);
+	if (!wl_list_empty(&ctx->occluded_link)) {
+		// the callbacks would be moved to the surface right after this hook
+		wl_list_insert_list(&ctx->held_frames, &surface->pending.frame_callback_list);
+		wl_list_init(&surface->pending.frame_callback_list);
+	} else if (ctx->max_fps > 0 && !wl_list_empty(&surface->pending.frame_callback_list)) {
+		ctx->pace_frames();
+	}
+	auto surface_size = std::make_pair(surface->width, surface->height);
+	if (was_mapped && ctx->dirty == 0 && ctx->view->output != nullptr) {
+		struct weston_output *output = ctx->head != nullptr
+		                                   ? weston_head_get_output(ctx->head)
+		                                   : weston_compositor_get_focused_output(surface->compositor);
+		// while a configure is pending, size changes wait for the commit that acks it
+		if (output != nullptr &&
+		    ctx->laid_out.matches(output,
+		                          ctx->configure_pending ? ctx->laid_out.surface_size : surface_size)) {
+			// contents only: the client's damage and the repaint are handled by weston_surface_commit
+			return;
+		}
+	}
+	if (!was_mapped) {
 		switch (ctx->layer) {
 			break;
 			case ZWLR_LAYER_SHELL_V1_LAYER_BACKGROUND:
@@ -209,50 +836,121 @@ static void committed_callback(struct weston_surface *surface, int32_t sx, int32
 		ctx->view->output = weston_compositor_get_focused_output(surface->compositor);
 	}
 	if (ctx->view->output == nullptr) {
-		weston_log("layer-shell: WTF: no output for surface from focus\n");
+		EXTRA_DIP_TRACE(trace, EXTRA_DIP_TRACE_INFO, "no focused output for surface",
+		                reinterpret_cast<intptr_t>(surface));
 		weston_view_update_transform(ctx->view);  // assigns an output if there was none
 	}
 	if (ctx->view->output == nullptr) {
 		weston_log("layer-shell: WTF: no calculated output for surface\n");
 		return;
 	}
-	auto output_size = std::make_pair(ctx->view->output->width, ctx->view->output->height);
-	weston_log("layer-shell: output size: %d, %d\n", ctx->view->output->width,
-	           ctx->view->output->height);
-	auto surface_size = std::make_pair(surface->width, surface->height);
-	weston_log("layer-shell: surface size: %d, %d\n", surface->width, surface->height);
-	int32_t x, y, nw, nh;
+	struct weston_output *output = ctx->view->output;
+	auto output_size = std::make_pair(output->width, output->height);
+	int32_t x, y;
 	std::tie(x, y) = ctx->position(surface_size, output_size);
-	weston_log("layer-shell: calculated position + output position: %d + %d, %d + %d\n", x,
-	           ctx->view->output->x, y, ctx->view->output->y);
+	EXTRA_DIP_TRACE(trace, EXTRA_DIP_TRACE_DEBUG, "output position and size", ctx->view->output->x,
+	                ctx->view->output->y, ctx->view->output->width, ctx->view->output->height);
 	weston_view_set_position(ctx->view, x + ctx->view->output->x, y + ctx->view->output->y);
-	std::tie(nw, nh) = ctx->next_size(surface_size, output_size);
-	weston_log("layer-shell: next size: %d, %d\n", nw, nh);
-	if (nw != surface->width || nh != surface->height) {
-		weston_log("layer-shell: sending configure\n");
-		zwlr_layer_surface_v1_send_configure(ctx->resource, 0, nw, nh);
+	auto size = ctx->next_size(ctx->expected_size(surface_size), output_size);
+	EXTRA_DIP_TRACE(trace, EXTRA_DIP_TRACE_DEBUG, "surface position and size", x, y, surface->width,
+	                surface->height);
+	if (size != ctx->expected_size(surface_size)) {
+		ctx->configure(size);
 	}
 	weston_view_update_transform(
 	    ctx->view);  // -> view_assign_output -> view_set_output -> sets destroy listener
 	weston_surface_damage(surface);
 	weston_compositor_schedule_repaint(surface->compositor);
-	if ((ctx->layer == ZWLR_LAYER_SHELL_V1_LAYER_TOP ||
-	     ctx->layer == ZWLR_LAYER_SHELL_V1_LAYER_OVERLAY) &&
-	    ctx->keyboard_interactive) {
-		struct weston_seat *seat;  // TODO smarter than first seat
-		wl_list_for_each(seat, &surface->compositor->seat_list, link) { break; }
-		weston_view_activate(ctx->view, seat, WESTON_ACTIVATE_FLAG_CONFIGURE);
+	bool refocus = !was_mapped || (ctx->dirty & LSH_DIRTY_KEYBOARD) != 0;
+	if (!was_mapped || output != ctx->laid_out.output) {
+		ctx->place(output);
+	}
+	ctx->dirty = 0;
+	ctx->laid_out.output = output;
+	ctx->laid_out.output_x = output->x;
+	ctx->laid_out.output_y = output->y;
+	ctx->laid_out.output_width = output->width;
+	ctx->laid_out.output_height = output->height;
+	ctx->laid_out.surface_size = surface_size;
+	ctx->update_zone(true);
+	if (ctx->is_mirrored()) {
+		ctx->sync_mirrors();
+	}
+	if (refocus) {
+		ctx->update_focus_stack(true);
+	}
+	if (refocus && !wl_list_empty(&ctx->focus_link)) {
+		struct weston_seat *seat = seat_for_output(output);
+		if (seat != nullptr) {
+			weston_view_activate(ctx->view, seat, WESTON_ACTIVATE_FLAG_CONFIGURE);
+		}
+	}
+}
+
+static struct wl_event_source *mirrors_idle = nullptr;
+
+// Mirrored surfaces don't necessarily commit again after outputs change, so relayout them here
+static void on_mirrors_idle(void *data) {
+	mirrors_idle = nullptr;
+	struct lsh_context *ctx;
+	wl_list_for_each(ctx, &mirror_surfaces, mirror_link) {
+		if (!weston_view_is_mapped(ctx->view)) {
+			continue;
+		}
+		if (ctx->laid_out.output == nullptr) {
+			committed_callback(ctx->surface, 0, 0);
+		} else {
+			ctx->sync_mirrors();
+		}
 	}
+	weston_compositor_schedule_repaint(compositor);
 }
 
+static void on_outputs_changed(struct wl_listener *listener, void *data) {
+	if (mirrors_idle == nullptr && !wl_list_empty(&mirror_surfaces)) {
+		mirrors_idle =
+		    wl_event_loop_add_idle(wl_display_get_event_loop(compositor->wl_display), on_mirrors_idle,
+		                           nullptr);
+	}
+}
+
+static void on_output_created(struct wl_listener *listener, void *data) {
+	return_home(static_cast<struct weston_output *>(data));
+	on_outputs_changed(listener, data);
+}
+
+static void on_output_destroyed(struct wl_listener *listener, void *data) {
+	auto *output = static_cast<struct weston_output *>(data);
+	struct lsh_context *ctx;
+	wl_list_for_each(ctx, &mirror_surfaces, mirror_link) {
+		struct lsh_mirror *m, *tmp;
+		wl_list_for_each_safe(m, tmp, &ctx->mirrors, link) {
+			if (m->output == output) {
+				// the work area goes away with the output
+				m->zone = lsh_zone{};
+				ctx->destroy_mirror(m);
+			}
+		}
+	}
+	on_outputs_changed(listener, data);
+}
+
+static struct wl_listener output_created_listener {};
+static struct wl_listener output_destroyed_listener {};
+static struct wl_listener output_moved_listener {};
+static struct wl_listener output_resized_listener {};
+
 static void set_size(struct wl_client *client, struct wl_resource *resource, uint32_t width,
                      uint32_t height) {
 	auto *ctx = static_cast<struct lsh_context *>(wl_resource_get_user_data(resource));
 	if (ctx == nullptr) {
 		return;
 	}
-	ctx->req_size.first = width;
-	ctx->req_size.second = height;
+	auto size = std::make_pair(static_cast<int32_t>(width), static_cast<int32_t>(height));
+	if (size != ctx->req_size) {
+		ctx->req_size = size;
+		ctx->dirty |= LSH_DIRTY_SIZE;
+	}
 }
 
 static void set_anchor(struct wl_client *client, struct wl_resource *resource, uint32_t anchor) {
@@ -260,7 +958,10 @@ static void set_anchor(struct wl_client *client, struct wl_resource *resource, u
 	if (ctx == nullptr) {
 		return;
 	}
-	ctx->anchor = static_cast<zwlr_layer_surface_v1_anchor>(anchor);
+	if (anchor != ctx->anchor) {
+		ctx->anchor = static_cast<zwlr_layer_surface_v1_anchor>(anchor);
+		ctx->dirty |= LSH_DIRTY_ANCHOR;
+	}
 }
 
 static void set_exclusive_zone(struct wl_client *client, struct wl_resource *resource,
@@ -269,7 +970,10 @@ static void set_exclusive_zone(struct wl_client *client, struct wl_resource *res
 	if (ctx == nullptr) {
 		return;
 	}
-	ctx->excl_zone = zone;
+	if (zone != ctx->excl_zone) {
+		ctx->excl_zone = zone;
+		ctx->dirty |= LSH_DIRTY_EXCLUSIVE_ZONE;
+	}
 }
 
 static void set_margin(struct wl_client *client, struct wl_resource *resource, int32_t top,
@@ -278,10 +982,11 @@ static void set_margin(struct wl_client *client, struct wl_resource *resource, i
 	if (ctx == nullptr) {
 		return;
 	}
-	ctx->margin.top = top;
-	ctx->margin.right = right;
-	ctx->margin.bottom = bottom;
-	ctx->margin.left = left;
+	struct lsh_margin margin = {top, right, bottom, left};
+	if (!(margin == ctx->margin)) {
+		ctx->margin = margin;
+		ctx->dirty |= LSH_DIRTY_MARGIN;
+	}
 }
 
 static void set_keyboard_interactivity(struct wl_client *client, struct wl_resource *resource,
@@ -290,15 +995,30 @@ static void set_keyboard_interactivity(struct wl_client *client, struct wl_resou
 	if (ctx == nullptr) {
 		return;
 	}
-	ctx->keyboard_interactive = !!keyboard_interactivity;
+	if (!!keyboard_interactivity != ctx->keyboard_interactive) {
+		ctx->keyboard_interactive = !!keyboard_interactivity;
+		ctx->dirty |= LSH_DIRTY_KEYBOARD;
+		// a commit without a buffer doesn't reach committed_callback, so the stack is updated right
+		// away: a surface that stopped being interactive must not take focus on clicks
+		ctx->update_focus_stack(weston_view_is_mapped(ctx->view));
+	}
 }
 
 static void get_popup(struct wl_client *client, struct wl_resource *resource,
                       struct wl_resource *popup) {
-	weston_log("layer-shell: popup not supported yet\n");
+	EXTRA_DIP_TRACE(trace, EXTRA_DIP_TRACE_INFO, "popup not supported yet");
 }
 
 static void ack_configure(struct wl_client *client, struct wl_resource *resource, uint32_t serial) {
+	auto *ctx = static_cast<struct lsh_context *>(wl_resource_get_user_data(resource));
+	if (ctx == nullptr) {
+		return;
+	}
+	// acks of older configures are fine, the latest one is still coming
+	if (ctx->configure_pending && serial == ctx->configure_serial) {
+		ctx->configure_pending = false;
+		ctx->dirty |= LSH_DIRTY_CONFIGURE_ACKED;
+	}
 }
 
 static void destroy_lsh(struct wl_client *client, struct wl_resource *resource) {
@@ -323,10 +1043,9 @@ static void get_layer_surface(struct wl_client *client, struct wl_resource *reso
 	}
 
 	if (layer == ZWLR_LAYER_SHELL_V1_LAYER_OVERLAY &&
-	    !caps->check(caps->get(compositor), client, "layer-shell-overlay")) {
-		weston_log(
-		    "layer-shell: client %p does not have layer-shell-overlay capability, using top layer\n",
-		    client);
+	    !caps->check(caps->get(compositor), client, cap_layer_shell_overlay)) {
+		EXTRA_DIP_TRACE(trace, EXTRA_DIP_TRACE_INFO, "no overlay capability, using top layer",
+		                reinterpret_cast<intptr_t>(client));
 		layer = ZWLR_LAYER_SHELL_V1_LAYER_TOP;
 	}
 
@@ -341,14 +1060,20 @@ static void get_layer_surface(struct wl_client *client, struct wl_resource *reso
 	                 ? static_cast<struct weston_head *>(wl_resource_get_user_data(res_output))
 	                 : nullptr;
 
-	new lsh_context(surface, head, static_cast<zwlr_layer_shell_v1_layer>(layer), client, id);
+	// mirroring only makes sense for surfaces that aren't bound to an output
+	bool mirror =
+	    head == nullptr && strncmp(ns, lsh_mirror_prefix, sizeof(lsh_mirror_prefix) - 1) == 0;
+
+	new lsh_context(surface, head, static_cast<zwlr_layer_shell_v1_layer>(layer), ns, mirror,
+	                client, id);
 }
 
 static struct zwlr_layer_shell_v1_interface shell_impl = {get_layer_surface};
 
 static void bind_shell(struct wl_client *client, void *data, uint32_t version, uint32_t id) {
-	if (!caps->check(caps->get(compositor), client, "layer-shell")) {
-		weston_log("layer-shell: client %p does not have layer-shell capability\n", client);
+	if (!caps->check(caps->get(compositor), client, cap_layer_shell)) {
+		EXTRA_DIP_TRACE(trace, EXTRA_DIP_TRACE_INFO, "no layer-shell capability",
+		                reinterpret_cast<intptr_t>(client));
 		return;
 	}
 	struct wl_resource *resource = wl_resource_create(client, &zwlr_layer_shell_v1_interface, 1, id);
@@ -370,54 +1095,54 @@ static void lsh_get_output_work_area(struct desktop_shell *shell, struct weston_
 	area->width = output->width;
 	area->height = output->height;
 
-	for (auto &p : lsh_views) {
-		if (p.first->surface->output == output && p.second->excl_zone > 0) {
-			if (p.second->anchor == (l | r | t)) {
-				area->y += p.second->excl_zone;
-				area->height -= p.second->excl_zone;
-			} else if (p.second->anchor == (l | r | b)) {
-				area->height -= p.second->excl_zone;
-			} else if (p.second->anchor == (t | b | l)) {
-				area->x += p.second->excl_zone;
-				area->width -= p.second->excl_zone;
-			} else if (p.second->anchor == (t | b | r)) {
-				area->width -= p.second->excl_zone;
-			}
-		}
+	auto *lo = lsh_output_get(output, false);
+	if (lo != nullptr) {
+		area->x += lo->left;
+		area->y += lo->top;
+		area->width -= lo->left + lo->right;
+		area->height -= lo->top + lo->bottom;
 	}
 }
 
+static struct wl_signal *lsh_get_work_area_changed_signal(struct weston_compositor *compositor) {
+	return &work_area_changed_signal;
+}
+
+static const struct weston_extra_dip_layer_shell_api api = {lsh_get_work_area_changed_signal};
+
 // XXX: keyboard interactivity handling: fine for below-desktop, incomplete for above-desktop
 //
 // When a layer-shell surface gets focus, desktop shell will still think that it was focused,
 // so the Mod+Tab window switcher will go to the next surface on the first hit
 
+static struct lsh_context *lsh_context_from_view(struct weston_view *view) {
+	if (view->surface->committed != committed_callback) {
+		return nullptr;
+	}
+	return static_cast<struct lsh_context *>(view->surface->committed_private);
+}
+
 static bool refocus_topmost_interactive_surface(struct weston_seat *seat) {
 	// Relies on the fact that our binding runs after the desktop shell's because plugins are loaded
 	// after the shell!
-	for (auto &p : lsh_views) {
-		if (p.second->keyboard_interactive && p.second->layer == ZWLR_LAYER_SHELL_V1_LAYER_OVERLAY) {
-			weston_view_activate(p.first, seat, WESTON_ACTIVATE_FLAG_CONFIGURE);
-			return true;
-		}
+	struct wl_list *stack = !wl_list_empty(&focus_stack_overlay) ? &focus_stack_overlay
+	                                                             : &focus_stack_top;
+	if (wl_list_empty(stack)) {
+		return false;
 	}
-	for (auto &p : lsh_views) {
-		if (p.second->keyboard_interactive && p.second->layer == ZWLR_LAYER_SHELL_V1_LAYER_TOP) {
-			weston_view_activate(p.first, seat, WESTON_ACTIVATE_FLAG_CONFIGURE);
-			return true;
-		}
-	}
-	return false;
+	auto *ctx = wl_container_of(stack->next, static_cast<struct lsh_context *>(nullptr), focus_link);
+	weston_view_activate(ctx->view, seat, WESTON_ACTIVATE_FLAG_CONFIGURE);
+	return true;
 }
 
 static void click_to_activate_binding(struct weston_pointer *pointer, const struct timespec *time,
                                       uint32_t button, void *data) {
 	if (pointer->grab != &pointer->default_grab || pointer->focus == nullptr ||
-	    refocus_topmost_interactive_surface(pointer->seat) || lsh_views.count(pointer->focus) == 0) {
+	    refocus_topmost_interactive_surface(pointer->seat)) {
 		return;
 	}
-	auto *ctx = lsh_views[pointer->focus];
-	if (!ctx->keyboard_interactive) {
+	auto *ctx = lsh_context_from_view(pointer->focus);
+	if (ctx == nullptr || !ctx->keyboard_interactive) {
 		return;
 	}
 	weston_view_activate(pointer->focus, pointer->seat,
@@ -427,11 +1152,11 @@ static void click_to_activate_binding(struct weston_pointer *pointer, const stru
 static void touch_to_activate_binding(struct weston_touch *touch, const struct timespec *time,
                                       void *data) {
 	if (touch->grab != &touch->default_grab || touch->focus == nullptr ||
-	    refocus_topmost_interactive_surface(touch->seat) || lsh_views.count(touch->focus) == 0) {
+	    refocus_topmost_interactive_surface(touch->seat)) {
 		return;
 	}
-	auto *ctx = lsh_views[touch->focus];
-	if (!ctx->keyboard_interactive) {
+	auto *ctx = lsh_context_from_view(touch->focus);
+	if (ctx == nullptr || !ctx->keyboard_interactive) {
 		return;
 	}
 	weston_view_activate(touch->focus, touch->seat, WESTON_ACTIVATE_FLAG_CONFIGURE);
@@ -439,18 +1164,68 @@ static void touch_to_activate_binding(struct weston_touch *touch, const struct t
 
 WL_EXPORT int wet_module_init(struct weston_compositor *ec, int *argc, char *argv[]) {
 	compositor = ec;
+	wl_list_init(&focus_stack_top);
+	wl_list_init(&focus_stack_overlay);
+	wl_list_init(&mirror_surfaces);
+	wl_list_init(&occluded_surfaces);
+	wl_list_init(&paced_surfaces);
+	wl_list_init(&homeless_surfaces);
+	wl_list_init(&relayout_surfaces);
+	struct weston_config *config = wet_get_config(compositor);
+	struct weston_config_section *shell_section = nullptr;
+	if (config != nullptr) {
+		shell_section = weston_config_get_section(config, "layer-shell", nullptr, nullptr);
+	}
+	char *policy = nullptr;
+	weston_config_section_get_string(shell_section, "output-gone", &policy, "close");
+	if (policy != nullptr && strcmp(policy, "migrate") == 0) {
+		output_gone_policy = LSH_OUTPUT_GONE_MIGRATE;
+	} else if (policy != nullptr && strcmp(policy, "park") == 0) {
+		output_gone_policy = LSH_OUTPUT_GONE_PARK;
+	}
+	free(policy);
+	struct weston_config_section *section = nullptr;
+	const char *section_name = nullptr;
+	while (config != nullptr && weston_config_next_section(config, &section, &section_name) != 0) {
+		if (strcmp(section_name, "layer-shell-frame-rate") != 0) {
+			continue;
+		}
+		char *ns = nullptr;
+		int32_t fps = 0;
+		weston_config_section_get_string(section, "namespace", &ns, nullptr);
+		weston_config_section_get_int(section, "max-fps", &fps, 0);
+		if (ns != nullptr && fps > 0) {
+			namespace_fps[ns] = static_cast<uint32_t>(fps);
+		}
+		free(ns);
+	}
+	pacing_timer = wl_event_loop_add_timer(wl_display_get_event_loop(compositor->wl_display),
+	                                       on_pacing_timer, nullptr);
+	const char *fps = getenv("EXTRA_DIP_OCCLUDED_FPS");
+	if (fps != nullptr) {
+		// the timer has millisecond resolution and an interval of 0 would disarm it
+		occluded_fps = static_cast<uint32_t>(std::min(strtoul(fps, nullptr, 10), 1000UL));
+	}
+	occluded_timer = wl_event_loop_add_timer(wl_display_get_event_loop(compositor->wl_display),
+	                                         on_occluded_timer, nullptr);
 	if ((desk_shell = weston_desktop_shell_get_api(compositor)) == nullptr) {
 		weston_log("layer-shell: did not find desktop-shell api, are you using the correct weston?\n");
 		return -1;
 	}
-	if ((caps = weston_extra_dip_capabilities_get_api(compositor)) == nullptr) {
+	if ((caps = weston_extra_dip_capabilities_get_api_v2(compositor)) == nullptr) {
 		weston_log(
 		    "layer-shell: did not find capabilities api, did you put the capabilities plugin before "
 		    "this one?\n");
 		return -1;
 	}
-	caps->create(caps->get(compositor), "layer-shell");
-	caps->create(caps->get(compositor), "layer-shell-overlay");
+	extra_dip_trace_init(compositor, &trace, EXTRA_DIP_TRACE_API_NAME("layer-shell"));
+	wl_signal_init(&work_area_changed_signal);
+	if (weston_plugin_api_register(compositor, WESTON_EXTRA_DIP_LAYER_SHELL_API_NAME, &api,
+	                               sizeof(api)) < 0) {
+		return -1;
+	}
+	cap_layer_shell = caps->create(caps->get(compositor), "layer-shell");
+	cap_layer_shell_overlay = caps->create(caps->get(compositor), "layer-shell-overlay");
 	desk_shell->set_output_work_area_fn(desk_shell->get(compositor), lsh_get_output_work_area);
 	weston_layer_init(&lr_background, compositor);
 	weston_layer_set_position(&lr_background, WESTON_LAYER_POSITION_BACKGROUND);
@@ -466,6 +1241,14 @@ WL_EXPORT int wet_module_init(struct weston_compositor *ec, int *argc, char *arg
 	                                     click_to_activate_binding, nullptr);
 	weston_compositor_add_touch_binding(ec, static_cast<enum weston_keyboard_modifier>(0),
 	                                    touch_to_activate_binding, nullptr);
+	output_created_listener.notify = on_output_created;
+	wl_signal_add(&compositor->output_created_signal, &output_created_listener);
+	output_destroyed_listener.notify = on_output_destroyed;
+	wl_signal_add(&compositor->output_destroyed_signal, &output_destroyed_listener);
+	output_moved_listener.notify = on_outputs_changed;
+	wl_signal_add(&compositor->output_moved_signal, &output_moved_listener);
+	output_resized_listener.notify = on_outputs_changed;
+	wl_signal_add(&compositor->output_resized_signal, &output_resized_listener);
 	wl_global_create(compositor->wl_display, &zwlr_layer_shell_v1_interface, 1, nullptr, bind_shell);
 	return 0;
 }
@@ -5,6 +5,7 @@ extern "C" {
 #endif
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <unistd.h>
 
 #include <plugin-registry.h>
@@ -37,6 +38,31 @@ static inline const struct weston_extra_dip_capabilities_api *weston_extra_dip_c
 	return (const struct weston_extra_dip_capabilities_api *)api;
 }
 
+#define WESTON_EXTRA_DIP_CAPABILITIES_API_V2_NAME "weston_extra_dip_capabilities_v2"
+
+#define WESTON_EXTRA_DIP_CAPABILITIES_MAX 64
+
+/* Capabilities are referred to by the id returned from create, checking is a bit test */
+struct weston_extra_dip_capabilities_api_v2 {
+	struct extra_dip_capabilities *(*get)(struct weston_compositor *compositor);
+
+	/* Returns the id of the capability (creating it if it doesn't exist yet),
+	 * or -1 when WESTON_EXTRA_DIP_CAPABILITIES_MAX capabilities already exist */
+	int32_t (*create)(struct extra_dip_capabilities *caps, const char *capability);
+	bool (*check)(struct extra_dip_capabilities *caps, struct wl_client *client, int32_t capability);
+	void (*grant)(struct extra_dip_capabilities *caps, struct wl_client *client, int32_t capability);
+	void (*revoke)(struct extra_dip_capabilities *caps, struct wl_client *client, int32_t capability);
+};
+
+static inline const struct weston_extra_dip_capabilities_api_v2 *
+weston_extra_dip_capabilities_get_api_v2(struct weston_compositor *compositor) {
+	const void *api;
+	api = weston_plugin_api_get(compositor, WESTON_EXTRA_DIP_CAPABILITIES_API_V2_NAME,
+	                            sizeof(struct weston_extra_dip_capabilities_api_v2));
+	/* The cast is necessary to use this function in C++ code */
+	return (const struct weston_extra_dip_capabilities_api_v2 *)api;
+}
+
 #ifdef __cplusplus
 }
 #endif
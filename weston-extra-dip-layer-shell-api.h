@@ -0,0 +1,34 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <plugin-registry.h>
+
+struct weston_compositor;
+struct wl_signal;
+
+#define WESTON_EXTRA_DIP_LAYER_SHELL_API_NAME "weston_extra_dip_layer_shell_v1"
+
+struct weston_extra_dip_layer_shell_api {
+	/* Emitted with the weston_output whose work area (the output minus the exclusive zones of
+	 * layer surfaces) changed. Shells should re-lay out maximized and fullscreen surfaces.
+	 * The desktop-shell API has no way to be told about changes, so desktop-shell only
+	 * reacts to this once the weston fork's desktop-shell subscribes to it. Until then it
+	 * picks up the new work area the next time it asks for it (maximize, placement) */
+	struct wl_signal *(*get_work_area_changed_signal)(struct weston_compositor *compositor);
+};
+
+static inline const struct weston_extra_dip_layer_shell_api *weston_extra_dip_layer_shell_get_api(
+    struct weston_compositor *compositor) {
+	const void *api;
+	api = weston_plugin_api_get(compositor, WESTON_EXTRA_DIP_LAYER_SHELL_API_NAME,
+	                            sizeof(struct weston_extra_dip_layer_shell_api));
+	/* The cast is necessary to use this function in C++ code */
+	return (const struct weston_extra_dip_layer_shell_api *)api;
+}
+
+#ifdef __cplusplus
+}
+#endif
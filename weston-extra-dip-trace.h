@@ -0,0 +1,141 @@
+#pragma once
+
+// Binary trace events for the extra-dip plugins. Each plugin records into its own fixed-size ring,
+// registered as a plugin API so that compositor-management can dump all of them (dump_trace request
+// or SIGUSR2). Events above EXTRA_DIP_TRACE_MAX_LEVEL are compiled out, the rest are gated by the
+// ring's runtime level, initially taken from the EXTRA_DIP_TRACE_LEVEL environment variable
+
+#include <atomic>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+
+extern "C" {
+#include <plugin-registry.h>
+}
+
+enum extra_dip_trace_level : uint32_t {
+	EXTRA_DIP_TRACE_OFF = 0,
+	EXTRA_DIP_TRACE_ERROR = 1,
+	EXTRA_DIP_TRACE_INFO = 2,
+	EXTRA_DIP_TRACE_DEBUG = 3,
+};
+
+#ifndef EXTRA_DIP_TRACE_MAX_LEVEL
+#define EXTRA_DIP_TRACE_MAX_LEVEL EXTRA_DIP_TRACE_INFO
+#endif
+
+#define EXTRA_DIP_TRACE_API_NAME(plugin) ("weston_extra_dip_trace_v1_" plugin)
+
+const size_t extra_dip_trace_ring_size = 1024;
+
+struct extra_dip_trace_record {
+	// index + 1 once the record is complete, 0 while it's being written
+	std::atomic<uint64_t> seq{0};
+	uint64_t time_nsec;
+	// a string literal, weston never unloads plugins
+	const char *what;
+	uint32_t level;
+	int64_t args[4];
+};
+
+// Writers claim a slot with one fetch_add, there are no locks. A reader skips records that were
+// being overwritten while it copied them
+struct extra_dip_trace_ring {
+	const char *plugin;
+	std::atomic<uint32_t> level{EXTRA_DIP_TRACE_INFO};
+	std::atomic<uint64_t> head{0};
+	extra_dip_trace_record records[extra_dip_trace_ring_size];
+
+	explicit extra_dip_trace_ring(const char *p) : plugin(p) {}
+	extra_dip_trace_ring(extra_dip_trace_ring &&) = delete;
+};
+
+static const char *const extra_dip_trace_api_names[] = {
+    EXTRA_DIP_TRACE_API_NAME("capabilities"),
+    EXTRA_DIP_TRACE_API_NAME("layer-shell"),
+    EXTRA_DIP_TRACE_API_NAME("compositor-management"),
+};
+
+#define EXTRA_DIP_TRACE(ring, lvl, ...)                                 \
+	do {                                                                  \
+		if ((lvl) <= EXTRA_DIP_TRACE_MAX_LEVEL &&                           \
+		    (lvl) <= (ring).level.load(std::memory_order_relaxed)) {        \
+			extra_dip_trace_record_event(&(ring), (lvl), __VA_ARGS__);        \
+		}                                                                   \
+	} while (0)
+
+static inline void extra_dip_trace_record_event(struct extra_dip_trace_ring *ring, uint32_t level,
+                                                const char *what, int64_t a = 0, int64_t b = 0,
+                                                int64_t c = 0, int64_t d = 0) {
+	uint64_t idx = ring->head.fetch_add(1, std::memory_order_relaxed);
+	auto &rec = ring->records[idx % extra_dip_trace_ring_size];
+	rec.seq.store(0, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	struct timespec now {};
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	rec.time_nsec = static_cast<uint64_t>(now.tv_sec) * 1000000000 + now.tv_nsec;
+	rec.what = what;
+	rec.level = level;
+	rec.args[0] = a;
+	rec.args[1] = b;
+	rec.args[2] = c;
+	rec.args[3] = d;
+	rec.seq.store(idx + 1, std::memory_order_release);
+}
+
+static inline int extra_dip_trace_init(struct weston_compositor *compositor,
+                                       struct extra_dip_trace_ring *ring, const char *api_name) {
+	const char *env = getenv("EXTRA_DIP_TRACE_LEVEL");
+	if (env != nullptr) {
+		ring->level.store(static_cast<uint32_t>(strtoul(env, nullptr, 10)),
+		                  std::memory_order_relaxed);
+	}
+	return weston_plugin_api_register(compositor, api_name, ring, sizeof(*ring));
+}
+
+static inline struct extra_dip_trace_ring *extra_dip_trace_get(struct weston_compositor *compositor,
+                                                               const char *api_name) {
+	// the API is registered as the ring itself, which stays writable
+	return const_cast<struct extra_dip_trace_ring *>(static_cast<const struct extra_dip_trace_ring *>(
+	    weston_plugin_api_get(compositor, api_name, sizeof(struct extra_dip_trace_ring))));
+}
+
+static inline void extra_dip_trace_set_level(struct weston_compositor *compositor, uint32_t level) {
+	for (const char *api_name : extra_dip_trace_api_names) {
+		auto *ring = extra_dip_trace_get(compositor, api_name);
+		if (ring != nullptr) {
+			ring->level.store(level, std::memory_order_relaxed);
+		}
+	}
+}
+
+// One line per record: seconds, plugin, event, arguments
+static inline void extra_dip_trace_dump(struct weston_compositor *compositor, FILE *out) {
+	for (const char *api_name : extra_dip_trace_api_names) {
+		auto *ring = extra_dip_trace_get(compositor, api_name);
+		if (ring == nullptr) {
+			continue;
+		}
+		uint64_t head = ring->head.load(std::memory_order_acquire);
+		uint64_t first = head > extra_dip_trace_ring_size ? head - extra_dip_trace_ring_size : 0;
+		for (uint64_t i = first; i < head; i++) {
+			const auto &rec = ring->records[i % extra_dip_trace_ring_size];
+			if (rec.seq.load(std::memory_order_acquire) != i + 1) {
+				continue;
+			}
+			uint64_t time_nsec = rec.time_nsec;
+			const char *what = rec.what;
+			int64_t args[4] = {rec.args[0], rec.args[1], rec.args[2], rec.args[3]};
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (rec.seq.load(std::memory_order_relaxed) != i + 1) {
+				continue;
+			}
+			fprintf(out,
+			        "%" PRIu64 ".%06" PRIu64 " %s: %s %" PRId64 " %" PRId64 " %" PRId64 " %" PRId64 "\n",
+			        time_nsec / 1000000000, time_nsec % 1000000000 / 1000, ring->plugin, what, args[0],
+			        args[1], args[2], args[3]);
+		}
+	}
+}